@@ -0,0 +1,57 @@
+#!/bin/sh
+# Linux build with gcc, Windows builds lfmp.sln.
+#
+#   ./build.sh [lfmp|latency|preload|all]
+#
+# lfmp:     the benchmark driver
+# latency:  lfmp_latency, the driver with MP_LATENCY_HISTOGRAM for lfmp -l
+# preload:  libmp_preload.so, the LD_PRELOAD malloc interposer of mp_preload.c
+#
+# CC, CXX and CFLAGS are taken from the environment.
+
+set -e
+cd "$(dirname "$0")"
+
+CC=${CC:-gcc}
+CXX=${CXX:-g++}
+CFLAGS=${CFLAGS:--O2 -g}
+FLAGS="-pthread -Wall -Wno-multichar"
+case $(uname -m) in
+    x86_64) FLAGS="$FLAGS -mcx16" ;;
+esac
+POOL_SRCS="mem_pool.c mem_utils.c kprint.c numa_defs.c thread_defs.c event.c"
+OBJ_DIR=$(mktemp -d)
+trap 'rm -rf "$OBJ_DIR"' EXIT
+
+# compile_c <defines> <sources>, object names go to $OBJS
+compile_c()
+{
+    OBJS=""
+    for f in $2; do
+        $CC $CFLAGS $FLAGS $1 -c "$f" -o "$OBJ_DIR/${f%.c}.o"
+        OBJS="$OBJS $OBJ_DIR/${f%.c}.o"
+    done
+}
+
+# build_lfmp <output> <defines>
+build_lfmp()
+{
+    compile_c "$2" "$POOL_SRCS mp_arena.c"
+    $CXX $CFLAGS $FLAGS $2 -o $1 lfmp.cpp $OBJS -latomic
+}
+
+# pool blocks are told from glibc ones with the page map, so the
+# interposer needs the headerless build
+build_preload()
+{
+    compile_c "-fPIC -ftls-model=initial-exec -DMP_SLIST_TAGGED -DMP_HEADERLESS_SMALL" "$POOL_SRCS mp_preload.c"
+    $CC -shared $CFLAGS $FLAGS -o libmp_preload.so $OBJS -ldl -latomic
+}
+
+case ${1:-lfmp} in
+    lfmp) build_lfmp lfmp "" ;;
+    latency) build_lfmp lfmp_latency -DMP_LATENCY_HISTOGRAM ;;
+    preload) build_preload ;;
+    all) build_lfmp lfmp ""; build_lfmp lfmp_latency -DMP_LATENCY_HISTOGRAM; build_preload ;;
+    *) echo "usage: $0 [lfmp|latency|preload|all]"; exit 1 ;;
+esac
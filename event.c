@@ -1,22 +1,64 @@
 #include "event.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "interlocked_defs.h"
 #include <time.h>
 
 #ifndef WIN32
-#include <sys/time.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #endif
 
 #define INFINITE 0xFFFFFFFF
 
+#if defined(__linux__)
+// deadline is absolute on CLOCK_MONOTONIC, NULL waits forever
+static int futex_wait(volatile int *addr, int value, const struct timespec *deadline)
+{
+    return (int)syscall(SYS_futex, addr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, value, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static void futex_wake(volatile int *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, NULL, NULL, 0);
+}
+
+static void init_event_mode(event_t *event, int manual_reset)
+{
+    event->flag = 0;
+    event->waiters = 0;
+    event->manual_reset = manual_reset;
+}
+
+// takes the signal, an auto-reset event gives it to one waiter only
+static int event_try_wait(event_t *event)
+{
+    if (event->manual_reset)
+    {
+        return InterlockedRead(event->flag) != 0;
+    }
+    return InterlockedRead(event->flag) != 0 && InterlockedCompareExchange(&event->flag, 0, 1) == 1;
+}
+#endif
+
 void init_event(event_t *event)
 {
 #ifdef WIN32
     *event = CreateEvent(NULL, FALSE, FALSE, NULL);
 #elif defined(__linux__)
-    pthread_cond_init(&event->cond, NULL);
-    pthread_mutex_init(&event->mutex, NULL);
+    init_event_mode(event, 0);
+#endif
+}
+
+void init_manual_reset_event(event_t *event)
+{
+#ifdef WIN32
+    *event = CreateEvent(NULL, TRUE, FALSE, NULL);
+#elif defined(__linux__)
+    init_event_mode(event, 1);
 #endif
 }
 
@@ -25,11 +67,12 @@ void set_event(event_t *event)
 #ifdef WIN32
     SetEvent(*event);
 #elif defined(__linux__)
-    InterlockedExchange(&event->flag, 1);
-
-    pthread_mutex_lock(&event->mutex);
-    pthread_cond_signal(&event->cond);
-    pthread_mutex_unlock(&event->mutex);
+    // waiters count themselves before they look at the flag, the exchange
+    // is a full barrier so the waiters read can't pass the flag store
+    if (InterlockedExchange(&event->flag, 1) == 0 && InterlockedRead(event->waiters) != 0)
+    {
+        futex_wake(&event->flag, event->manual_reset ? INT_MAX : 1);
+    }
 #endif
 }
 
@@ -39,58 +82,40 @@ wait_rc_t wait_event(event_t *event, unsigned int msec)
     return WaitForSingleObject(*event, msec);
 #elif defined(__linux__)
     int rc;
+    struct timespec deadline;
 
-    if (InterlockedRead(event->flag) == 0)
+    if (event_try_wait(event))
     {
-        if (msec == INFINITE)
-        {
-            pthread_mutex_lock(&event->mutex);
-            if (InterlockedRead(event->flag) == 0)
-            {
-                rc = pthread_cond_wait(&event->cond, &event->mutex);
-            }
-            else
-            {
-                InterlockedCompareExchange(&event->flag, 0, 1);
-                rc = WAIT_OBJECT_0;
-            }
-            pthread_mutex_unlock(&event->mutex);
-        }
-        else
+        return WAIT_OBJECT_0;
+    }
+    if (msec == 0)
+    {
+        return WAIT_TIMEOUT;
+    }
+    if (msec != INFINITE)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += msec / 1000;
+        deadline.tv_nsec += (long)(msec % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
         {
-            int sec;
-            struct timeval now;
-            struct timespec timeout;
-            if (msec < 1000)
-            {
-                sec = 1;
-            }
-            else
-            {
-                sec = msec / 1000;
-            }
-            gettimeofday(&now, NULL);
-            timeout.tv_sec = now.tv_sec + sec;
-            timeout.tv_nsec = now.tv_usec * 1000;
-
-            pthread_mutex_lock(&event->mutex);
-            if (InterlockedRead(event->flag) == 0)
-            {
-                rc = pthread_cond_timedwait(&event->cond, &event->mutex, &timeout);
-            }
-            else
-            {
-                InterlockedCompareExchange(&event->flag, 0, 1);
-                rc = WAIT_OBJECT_0;
-            }
-            pthread_mutex_unlock(&event->mutex);
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
         }
     }
-    else
+    rc = WAIT_OBJECT_0;
+    InterlockedIncrement(&event->waiters);
+    while (!event_try_wait(event))
     {
-        InterlockedCompareExchange(&event->flag, 0, 1);
-        rc = WAIT_OBJECT_0;
+        // the kernel checks the flag is still 0 before sleeping
+        if (futex_wait(&event->flag, 0, (msec == INFINITE) ? NULL : &deadline) != 0 && errno == ETIMEDOUT)
+        {
+            // a set racing with the timeout still counts
+            rc = event_try_wait(event) ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+            break;
+        }
     }
+    InterlockedDecrement(&event->waiters);
     return rc;
 #endif
 }
@@ -14,13 +14,14 @@ extern  "C"
 #define wait_rc_t DWORD
 
 #elif __linux__
-#include <pthread.h>
 
+// a futex word: set and wait only enter the kernel when a thread has to
+// sleep or be woken
 typedef struct
 {
-    volatile int flag;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+    volatile int flag;          // 1 while signaled
+    volatile int waiters;
+    int manual_reset;
 } event_t;
 
 #define wait_rc_t       int
@@ -30,7 +31,10 @@ typedef struct
 
 #endif
 
+// auto-reset: a wait consumes the signal and set wakes one waiter
 void init_event(event_t *event);
+// manual-reset: signaled until reset_event, set wakes every waiter
+void init_manual_reset_event(event_t *event);
 void set_event(event_t *event);
 wait_rc_t wait_event(event_t *event, unsigned int msec);
 void reset_event(event_t *event);
@@ -7,15 +7,44 @@
 
 #define InterlockedCompareExchange(d, e, c)         __sync_val_compare_and_swap(d, c, e)
 #define InterlockedCompareExchangePointer(d, e, c)  __sync_val_compare_and_swap(d, c, e)
-#define InterlockedExchange                         __sync_lock_test_and_set 
+// a full barrier like the Win32 one, __sync_lock_test_and_set only acquires
+#define InterlockedExchange(d, v)                   __atomic_exchange_n(d, v, __ATOMIC_SEQ_CST)
 #define InterlockedIncrement(x)                     __sync_add_and_fetch(x, 1)
 #define InterlockedDecrement(x)                     __sync_sub_and_fetch(x, 1)
 #define InterlockedRead(x)                          x
 #define InterlockedAdd(x, v)                        __sync_add_and_fetch(x, v)
 #define InterlockedSub(x, v)                        __sync_sub_and_fetch(x, v)
+#define InterlockedCompareExchange64(d, e, c)       __sync_val_compare_and_swap(d, c, e)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YieldProcessor()                            __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define YieldProcessor()                            __asm__ __volatile__("yield")
+#else
+#define YieldProcessor()                            __sync_synchronize()
+#endif
+
+#if defined(__x86_64__) || defined(__aarch64__)
+// same contract as the Win32 intrinsic, x86_64 needs -mcx16 to emit cmpxchg16b
+static __inline unsigned char InterlockedCompareExchange128(long long volatile *dest,
+    long long exchange_high,
+    long long exchange_low,
+    long long *comparand_result)
+{
+    __int128 comparand;
+    __int128 exchange;
+    __int128 prev;
+    comparand = ((__int128)comparand_result[1] << 64) | (unsigned long long)comparand_result[0];
+    exchange = ((__int128)exchange_high << 64) | (unsigned long long)exchange_low;
+    prev = __sync_val_compare_and_swap((__int128 volatile *)dest, comparand, exchange);
+    comparand_result[0] = (long long)prev;
+    comparand_result[1] = (long long)(prev >> 64);
+    return prev == comparand;
+}
+#endif
 
 //#ifdef NO_USE_WALL_FLAGS
-#define InterlockedExchangePointer                  __sync_lock_test_and_set 
+#define InterlockedExchangePointer(d, v)            __atomic_exchange_n(d, v, __ATOMIC_SEQ_CST)
 //#else
 //static __inline void *InterlockedExchangePointer(void *volatile *ptr, void *value)
 //{
@@ -0,0 +1,451 @@
+#if !defined(NDIS_WDM) && !defined(WIN32)
+#define _GNU_SOURCE
+#endif
+#include "kprint.h"
+#include "mem_utils.h"
+#include "interlocked_defs.h"
+
+#ifdef NDIS_WDM
+#include "Ntstrsafe.h"
+#else
+#include <stdarg.h>
+#include <string.h>
+#include "event.h"
+#endif
+
+#if !defined(NDIS_WDM) && !defined(WIN32)
+#include <sched.h>
+#include <time.h>
+#endif
+
+// a ring per cpu, cpus beyond KPRINT_RINGS share them. Writers of a ring
+// reserve space with a CAS on its head, the reader frees it by moving the
+// tail. A record doesn't wrap around, the end of the ring is skipped with
+// a padding record instead.
+#define KPRINT_RINGS        16
+#define KPRINT_RING_SIZE    0x10000
+// records start at multiples of it, so a padding record always has room
+// for its header
+#define KPRINT_ALIGN        32
+#ifdef NDIS_WDM
+#define KPRINT_MAX_LENGTH   256
+#else
+#define KPRINT_MAX_LENGTH   1024
+#endif
+#define KPRINT_TAG          'rkfl'
+// a wakeup lost to a racing writer costs the reader this much at most
+#define KPRINT_WAIT_MSEC    100
+
+#define KPRINT_RECORD_FREE      0
+#define KPRINT_RECORD_READY     1
+#define KPRINT_RECORD_PADDING   2
+
+typedef struct _kprint_record
+{
+    volatile long state;
+    int size;           // of the whole record, header and padding included
+    int length;
+    int flag;
+    LARGE_INTEGER time;
+} kprint_record_t;
+
+typedef struct _kprint_ring
+{
+    volatile long head;     // free running, the mask makes an offset of it
+    volatile long tail;
+    volatile long dropped;
+    volatile long lost;     // the next record gets KPRINT_ENTRY_LOST
+    volatile long writers;  // in kprint_ring_write, clear waits for them
+    unsigned char *data;
+} kprint_ring_t;
+
+static kprint_ring_t g_kprint_rings[KPRINT_RINGS] = { 0 };
+static volatile long g_kprint_active = 0;
+static volatile long g_kprint_waiting = 0;
+#ifdef NDIS_WDM
+static KEVENT g_kprint_event;
+#else
+static event_t g_kprint_event;
+#endif
+
+#define KPRINT_ROUND(x) (((x) + KPRINT_ALIGN - 1) & ~(KPRINT_ALIGN - 1))
+#define KPRINT_RECORD(ring, pos) ((kprint_record_t *)((ring)->data + ((pos) & (KPRINT_RING_SIZE - 1))))
+
+static kprint_ring_t *kprint_current_ring()
+{
+    int cpu;
+#if defined(NDIS_WDM)
+    cpu = (int)KeGetCurrentProcessorNumber();
+#elif defined(WIN32)
+    cpu = (int)GetCurrentProcessorNumber();
+#else
+    cpu = sched_getcpu();
+    if (cpu < 0)
+    {
+        cpu = 0;
+    }
+#endif
+    return &g_kprint_rings[cpu % KPRINT_RINGS];
+}
+
+static void kprint_time(LARGE_INTEGER *time)
+{
+#if defined(NDIS_WDM)
+    *time = KeQueryPerformanceCounter(NULL);
+#elif defined(WIN32)
+    QueryPerformanceCounter(time);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    time->QuadPart = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+static void kprint_signal()
+{
+#ifdef NDIS_WDM
+    KeSetEvent(&g_kprint_event, 0, FALSE);
+#else
+    set_event(&g_kprint_event);
+#endif
+}
+
+void init_kprint_ring()
+{
+    int i;
+    if (g_kprint_active)
+    {
+        return;
+    }
+#ifdef NDIS_WDM
+    KeInitializeEvent(&g_kprint_event, SynchronizationEvent, FALSE);
+#else
+    init_event(&g_kprint_event);
+#endif
+    for (i = 0; i < KPRINT_RINGS; i++)
+    {
+        g_kprint_rings[i].head = 0;
+        g_kprint_rings[i].tail = 0;
+        g_kprint_rings[i].dropped = 0;
+        g_kprint_rings[i].lost = 0;
+        g_kprint_rings[i].writers = 0;
+        // the ring logs the leak check of mp_clear, so it isn't counted by it
+        g_kprint_rings[i].data = (unsigned char *)internal_memory_alloc(KPRINT_RING_SIZE, KPRINT_TAG);
+        if (g_kprint_rings[i].data == NULL)
+        {
+            clear_kprint_ring();
+            return;
+        }
+        // every record starts KPRINT_RECORD_FREE
+        memset(g_kprint_rings[i].data, 0, KPRINT_RING_SIZE);
+    }
+    InterlockedExchange(&g_kprint_active, 1);
+}
+
+// NULL when the ring is full
+static kprint_record_t *kprint_ring_reserve(kprint_ring_t *ring, int size)
+{
+    long head;
+    long pad;
+    kprint_record_t *record;
+    for (;;)
+    {
+        head = ring->head;
+        pad = (long)(KPRINT_RING_SIZE - (head & (KPRINT_RING_SIZE - 1)));
+        if (pad >= size)
+        {
+            pad = 0;
+        }
+        if ((unsigned long)(head - ring->tail) + pad + size > KPRINT_RING_SIZE)
+        {
+            InterlockedIncrement(&ring->dropped);
+            InterlockedExchange(&ring->lost, 1);
+            return NULL;
+        }
+        if (head == InterlockedCompareExchange(&ring->head, head + pad + size, head))
+        {
+            break;
+        }
+    }
+    if (pad != 0)
+    {
+        record = KPRINT_RECORD(ring, head);
+        record->size = (int)pad;
+        InterlockedExchange(&record->state, KPRINT_RECORD_PADDING);
+        head += pad;
+    }
+    return KPRINT_RECORD(ring, head);
+}
+
+static void kprint_ring_write(const char *s, int length, int flag)
+{
+    int size;
+    kprint_ring_t *ring;
+    kprint_record_t *record;
+    ring = kprint_current_ring();
+    InterlockedIncrement(&ring->writers);
+    // clear_kprint_ring frees the rings once there's no writer left
+    if (g_kprint_active)
+    {
+        size = KPRINT_ROUND((int)sizeof(kprint_record_t) + length);
+        record = kprint_ring_reserve(ring, size);
+        if (record != NULL)
+        {
+            if (ring->lost && InterlockedExchange(&ring->lost, 0))
+            {
+                flag |= KPRINT_ENTRY_LOST;
+            }
+            record->size = size;
+            record->length = length;
+            record->flag = flag;
+            kprint_time(&record->time);
+            memcpy(record + 1, s, length);
+            InterlockedExchange(&record->state, KPRINT_RECORD_READY);
+            // the reader sets it before looking at the heads
+            if (g_kprint_waiting)
+            {
+                kprint_signal();
+            }
+        }
+    }
+    InterlockedDecrement(&ring->writers);
+}
+
+static void kprint_ring_consume(kprint_ring_t *ring, kprint_record_t *record)
+{
+    int size;
+    // the text may look like a header to a later lap of the ring
+    size = record->size;
+    memset(record, 0, size);
+    InterlockedExchange(&ring->tail, ring->tail + size);
+}
+
+// next record of the ring, NULL when it's empty or the writer isn't done
+static kprint_record_t *kprint_ring_peek(kprint_ring_t *ring)
+{
+    long state;
+    kprint_record_t *record;
+    for (;;)
+    {
+        if (ring->tail == ring->head)
+        {
+            return NULL;
+        }
+        record = KPRINT_RECORD(ring, ring->tail);
+        state = record->state;
+        if (state == KPRINT_RECORD_READY)
+        {
+            return record;
+        }
+        if (state != KPRINT_RECORD_PADDING)
+        {
+            return NULL;
+        }
+        kprint_ring_consume(ring, record);
+    }
+}
+
+void kprint_ring_read(void(*handle_data)(LARGE_INTEGER *time, void *data, int length, int entry_flag, void *user_data),
+    void *user_data)
+{
+    int i;
+    kprint_ring_t *ring;
+    kprint_record_t *record;
+    kprint_record_t *first;
+    // still readable after kprint_ring_close
+    if (g_kprint_rings[0].data == NULL)
+    {
+        return;
+    }
+    for (;;)
+    {
+        // merges the rings by time
+        first = NULL;
+        ring = NULL;
+        for (i = 0; i < KPRINT_RINGS; i++)
+        {
+            record = kprint_ring_peek(&g_kprint_rings[i]);
+            if (record != NULL && (first == NULL || record->time.QuadPart < first->time.QuadPart))
+            {
+                first = record;
+                ring = &g_kprint_rings[i];
+            }
+        }
+        if (first == NULL)
+        {
+            break;
+        }
+        handle_data(&first->time, first + 1, first->length, first->flag, user_data);
+        kprint_ring_consume(ring, first);
+    }
+}
+
+// whether a record is done, reserved ones still being written don't count.
+// For the reader only, it consumes padding records.
+static int kprint_ring_has_data()
+{
+    int i;
+    for (i = 0; i < KPRINT_RINGS; i++)
+    {
+        if (kprint_ring_peek(&g_kprint_rings[i]) != NULL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void kprint_ring_wait_data()
+{
+#ifdef NDIS_WDM
+    LARGE_INTEGER timeout;
+    timeout.QuadPart = -10000LL * KPRINT_WAIT_MSEC;
+#endif
+    while (g_kprint_active && !kprint_ring_has_data())
+    {
+        InterlockedExchange(&g_kprint_waiting, 1);
+        if (!kprint_ring_has_data() && g_kprint_active)
+        {
+#ifdef NDIS_WDM
+            KeWaitForSingleObject(&g_kprint_event, Executive, KernelMode, FALSE, &timeout);
+#else
+            wait_event(&g_kprint_event, KPRINT_WAIT_MSEC);
+#endif
+        }
+        InterlockedExchange(&g_kprint_waiting, 0);
+    }
+}
+
+// stops the writers and wakes the reader, the records stay readable
+void kprint_ring_close()
+{
+    if (InterlockedCompareExchange(&g_kprint_active, 0, 1) == 1)
+    {
+        kprint_signal();
+    }
+}
+
+void clear_kprint_ring()
+{
+    int i;
+    kprint_ring_close();
+    for (i = 0; i < KPRINT_RINGS; i++)
+    {
+        while (g_kprint_rings[i].writers != 0)
+        {
+            YieldProcessor();
+        }
+        if (g_kprint_rings[i].data != NULL)
+        {
+            internal_memory_free(g_kprint_rings[i].data);
+            g_kprint_rings[i].data = NULL;
+        }
+        g_kprint_rings[i].head = 0;
+        g_kprint_rings[i].tail = 0;
+    }
+#ifndef NDIS_WDM
+    close_event(&g_kprint_event);
+#endif
+}
+
+BOOL kprint_ring_is_active()
+{
+    return g_kprint_active ? TRUE : FALSE;
+}
+
+long kprint_ring_get_pending_write()
+{
+    int i;
+    long pending = 0;
+    for (i = 0; i < KPRINT_RINGS; i++)
+    {
+        pending += (long)(g_kprint_rings[i].head - g_kprint_rings[i].tail);
+    }
+    return pending;
+}
+
+long kprint_ring_get_dropped()
+{
+    int i;
+    long dropped = 0;
+    for (i = 0; i < KPRINT_RINGS; i++)
+    {
+        dropped += g_kprint_rings[i].dropped;
+    }
+    return dropped;
+}
+
+int kprint(const char *s)
+{
+    size_t length;
+    if (!g_kprint_active)
+    {
+#ifdef NDIS_WDM
+        return (int)DbgPrint("%s", s);
+#else
+        return fputs(s, stdout);
+#endif
+    }
+#ifdef NDIS_WDM
+    if (STATUS_SUCCESS != RtlStringCchLengthA(s, KPRINT_MAX_LENGTH, &length))
+    {
+        length = KPRINT_MAX_LENGTH + 1;
+    }
+#else
+    length = strlen(s);
+#endif
+    if (length > KPRINT_MAX_LENGTH)
+    {
+        kprint_ring_write(s, KPRINT_MAX_LENGTH, KPRINT_ENTRY_TRUNCATED);
+        return KPRINT_MAX_LENGTH;
+    }
+    kprint_ring_write(s, (int)length, 0);
+    return (int)length;
+}
+
+int kprintf(const char *fmt, ...)
+{
+    int length;
+    va_list args;
+    char buffer[KPRINT_MAX_LENGTH];
+    va_start(args, fmt);
+#ifdef NDIS_WDM
+    if (!g_kprint_active)
+    {
+        length = (int)vDbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, fmt, args);
+        va_end(args);
+        return length;
+    }
+    if (STATUS_SUCCESS != RtlStringCbVPrintfA(buffer, sizeof(buffer), fmt, args))
+    {
+        // the buffer holds the truncated text
+        length = sizeof(buffer);
+    }
+    else
+    {
+        length = (int)strlen(buffer);
+    }
+#else
+    if (!g_kprint_active)
+    {
+        length = vprintf(fmt, args);
+        va_end(args);
+        return length;
+    }
+    length = vsnprintf(buffer, sizeof(buffer), fmt, args);
+#endif
+    va_end(args);
+    if (length < 0)
+    {
+        return length;
+    }
+    if (length >= (int)sizeof(buffer))
+    {
+        kprint_ring_write(buffer, (int)strlen(buffer), KPRINT_ENTRY_TRUNCATED);
+    }
+    else
+    {
+        kprint_ring_write(buffer, length, 0);
+    }
+    return length;
+}
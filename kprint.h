@@ -9,30 +9,52 @@ extern "C"
 #ifdef NDIS_WDM
 #include "bool_type.h"
 #include <wdm.h>
-#else
+#elif defined(WIN32)
 #include <stdio.h>
 #include <Windows.h>
+#else
+#include <stdio.h>
+#include "bool_type.h"
+typedef union _LARGE_INTEGER
+{
+	struct
+	{
+		unsigned int LowPart;
+		int HighPart;
+	} u;
+	long long QuadPart;
+} LARGE_INTEGER;
 #endif
 
 #ifndef MIN
 #define MIN(_a, _b) ((_a) < (_b)? (_a): (_b))
 #endif
 
+// entry_flag of kprint_ring_read
+#define KPRINT_ENTRY_LOST		0x1	// records of the same ring were dropped just before this one
+#define KPRINT_ENTRY_TRUNCATED	0x2	// the message was cut to KPRINT_MAX_LENGTH
+
+// kprint and kprintf write into the ring of the current cpu once it's
+// initialized, they go to the debugger or stdout otherwise. One reader
+// drains all the rings, time is the performance counter (ns on Linux).
 void init_kprint_ring();
 void kprint_ring_read(void(*handle_data)(LARGE_INTEGER *time, void *data, int length, int entry_flag, void *user_data),
 	void *user_data);
+// returns once a record is ready to read or the ring is closed
 void kprint_ring_wait_data();
 void clear_kprint_ring();
 BOOL kprint_ring_is_active();
 void kprint_ring_close();
+// bytes reserved and not read yet, records still being written included
 long kprint_ring_get_pending_write();
+// records dropped because their ring was full
+long kprint_ring_get_dropped();
 
-#ifdef NDIS_WDM
-	int kprint(const char *s);
-	int kprintf(const char *fmt, ...);
-#else
-#define kprint puts
-#define kprintf printf
+int kprint(const char *s);
+int kprintf(const char *fmt, ...);
+
+#ifndef NDIS_WDM
+#define KdPrint(x) kprintf x
 #endif
 
 #define kdPrintString(x) KdPrint(("%s", x))
@@ -1,258 +1,1230 @@
 // lfmp.cpp : Defines the entry point for the console application.
 //
+// benchmark driver, compares the memory pool with the crt malloc.
+//
+// lfmp [-t threads[,threads...]] [-w alloc|bulk|vie|all] [-a malloc|pool|both]
+//      [-s min[:max]] [-d fixed|uniform|log] [-r producers:consumers]
+//      [-T seconds] [-b batch] [-m usable_percents] [-o table|csv|json]
+//      [-f file] [-v] [-l] [-c]
+//
+// alloc:  every thread allocates batch blocks and frees them again.
+// bulk:   the same with mp_malloc_bulk/mp_free_bulk, a loop for malloc.
+// vie:    producers hand blocks to consumers through shared slots.
+//
+// -l prints the pool's own latency histograms after each pool run, it
+// needs a build with MP_LATENCY_HISTOGRAM (./build.sh latency).
+//
+// -c runs checks of the pool api instead of the benchmarks, the exit code
+// is 1 when one of them fails.
+//
 //#include "stdafx.h"
 #include "mem_pool.h"
+#include "mem_pool.hpp"
+#include "mp_arena.h"
 #include "thread_defs.h"
+#include "event.h"
+#include "kprint.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include "interlocked_defs.h"
+#include <list>
+#include <map>
+#include <vector>
+
+#define MAX_THREAD_COUNTS       16
+#define MAX_BATCH_SIZE          256
+#define MAX_RESULTS             64
+#define SHARED_SLOTS            1024
+// one operation out of LATENCY_SAMPLE_INTERVAL is timed
+#define LATENCY_SAMPLE_INTERVAL 16
+#define MAX_LATENCY_SAMPLES     0x10000
 
-#define ALLOC_TIMES     100000
+#define WORKLOAD_ALLOC          1
+#define WORKLOAD_BULK           2
+#define WORKLOAD_VIE            4
 
-void *volatile ori_shared = NULL;
-void *volatile mp_shared = NULL;
+#define ALLOCATOR_MALLOC        1
+#define ALLOCATOR_POOL          2
 
-#define NZ_RAND_MAX 0x7fff
+enum { DIST_FIXED, DIST_UNIFORM, DIST_LOG };
+enum { OUTPUT_TABLE, OUTPUT_CSV, OUTPUT_JSON };
+enum { ROLE_BOTH, ROLE_PRODUCER, ROLE_CONSUMER };
 
-int nz_rand(int v)
+typedef struct
 {
-    v = v * 214013 + 2531011;
-    v = (v >> 16) & NZ_RAND_MAX;
-    if (v <= 0)
+    int threads[MAX_THREAD_COUNTS];
+    int thread_counts;
+    int workloads;
+    int allocators;
+    int min_size;
+    int max_size;
+    int dist;
+    int producers;
+    int consumers;
+    double seconds;
+    int batch;
+    int usable;
+    int output;
+    const char *file;
+    int verbose;
+    int latency;
+    int check;
+} bench_config_t;
+
+typedef struct
+{
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*free)(void *p);
+    int (*alloc_bulk)(size_t size, int n, void **p);
+    void (*free_bulk)(int n, void **p);
+} bench_allocator_t;
+
+typedef struct
+{
+    int id;
+    int role;
+    int workload;
+    const bench_allocator_t *allocator;
+    unsigned int seed;
+    unsigned long long ops;
+    double cpu;
+    unsigned int *samples;
+    unsigned int sample_count;
+} bench_thread_t;
+
+typedef struct
+{
+    const char *workload;
+    const char *allocator;
+    int threads;
+    unsigned long long ops;
+    double wall;
+    double cpu;
+    double ops_per_sec;
+    unsigned int p50;
+    unsigned int p90;
+    unsigned int p99;
+    unsigned int p999;
+    unsigned int max;
+} bench_result_t;
+
+bench_config_t g_config;
+bench_result_t g_results[MAX_RESULTS];
+int g_result_count = 0;
+
+// manual-reset, releases every thread of a run at once
+event_t g_start;
+volatile int g_stop = 0;
+volatile int g_log_stop = 0;
+int g_check_failed = 0;
+void *volatile g_shared[SHARED_SLOTS];
+
+int malloc_bulk(size_t size, int n, void **p)
+{
+    int i;
+    for (i = 0; i < n; i++)
     {
-        v = 1;
+        p[i] = malloc(size);
+        if (p[i] == NULL)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+void free_bulk(int n, void **p)
+{
+    for (int i = 0; i < n; i++)
+    {
+        free(p[i]);
     }
-    return v;
 }
 
-#define INITIAL_ALLOC_SIZE  1
-//#define FIXED_ALLOC_TEST
-#define MALLOC_ARRAY_SIZE   8
+void *pool_malloc(size_t size) { return mp_malloc(size); }
+void pool_free(void *p) { mp_free(p); }
+int pool_malloc_bulk(size_t size, int n, void **p) { return mp_malloc_bulk(size, n, p); }
+void pool_free_bulk(int n, void **p) { mp_free_bulk(n, p); }
+
+const bench_allocator_t g_malloc_allocator = { "malloc", malloc, free, malloc_bulk, free_bulk };
+const bench_allocator_t g_pool_allocator = { "pool", pool_malloc, pool_free, pool_malloc_bulk, pool_free_bulk };
 
-int get_next_size(int v)
+double wall_seconds()
 {
-#ifdef FIXED_ALLOC_TEST
-    return v;
+#ifdef WIN32
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+// cpu time of the calling thread only
+double thread_cpu_seconds()
+{
+#ifdef WIN32
+    FILETIME creation, exit, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+    return ((((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime)
+        + (((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime)) / 1e7;
+#else
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+unsigned long long now_ns()
+{
+#ifdef WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)(now.QuadPart * (1e9 / freq.QuadPart));
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+void sleep_seconds(double seconds)
+{
+#ifdef WIN32
+    Sleep((DWORD)(seconds * 1000));
 #else
-    return nz_rand(v);
+    timespec t;
+    t.tv_sec = (time_t)seconds;
+    t.tv_nsec = (long)((seconds - t.tv_sec) * 1e9);
+    while (nanosleep(&t, &t) != 0);
 #endif
 }
 
-void alloc_free_test(void *param, void *(*alloc_func)(size_t size), void(*free_func)(void *))
+unsigned int next_rand(unsigned int *seed)
+{
+    unsigned int v = *seed;
+    v ^= v << 13;
+    v ^= v >> 17;
+    v ^= v << 5;
+    *seed = v;
+    return v;
+}
+
+int log2_floor(unsigned int v)
+{
+    int n = 0;
+    while (v >>= 1)
+    {
+        n++;
+    }
+    return n;
+}
+
+size_t next_size(unsigned int *seed)
+{
+    unsigned int lo, hi;
+    int e;
+    switch (g_config.dist)
+    {
+    case DIST_FIXED:
+        return g_config.min_size;
+    case DIST_LOG:
+        // power of two picked uniformly, then a size within it
+        e = log2_floor(g_config.min_size)
+            + next_rand(seed) % (log2_floor(g_config.max_size) - log2_floor(g_config.min_size) + 1);
+        lo = 1u << e;
+        hi = (lo << 1) - 1;
+        if (lo < (unsigned int)g_config.min_size)
+        {
+            lo = g_config.min_size;
+        }
+        if (hi > (unsigned int)g_config.max_size)
+        {
+            hi = g_config.max_size;
+        }
+        return lo + next_rand(seed) % (hi - lo + 1);
+    default:
+        return g_config.min_size + next_rand(seed) % (g_config.max_size - g_config.min_size + 1);
+    }
+}
+
+static __inline void add_sample(bench_thread_t *t, unsigned long long ns)
+{
+    t->samples[t->sample_count++ % MAX_LATENCY_SAMPLES] =
+        (ns > 0xffffffffULL) ? 0xffffffff : (unsigned int)ns;
+}
+
+void alloc_free_test(bench_thread_t *t)
 {
-    int n = INITIAL_ALLOC_SIZE;
-    void *p[MALLOC_ARRAY_SIZE];
-    for (int i = 0; i < ALLOC_TIMES; i++)
+    void *p[MAX_BATCH_SIZE];
+    unsigned long long start;
+    unsigned long long i = 0;
+    const bench_allocator_t *a = t->allocator;
+    while (!g_stop)
     {
-        for (int j = 0; j < MALLOC_ARRAY_SIZE; j++)
+        for (int j = 0; j < g_config.batch; j++)
         {
-            p[j] = alloc_func(n);
+            size_t n = next_size(&t->seed);
+            if (++i % LATENCY_SAMPLE_INTERVAL == 0)
+            {
+                start = now_ns();
+                p[j] = a->alloc(n);
+                add_sample(t, now_ns() - start);
+            }
+            else
+            {
+                p[j] = a->alloc(n);
+            }
 #ifdef HAVE_ASSIGN
-            for (int k = 0; k < 1; k++)
+            if (p[j] != NULL)
             {
-                ((unsigned char *)p[j])[k] = ((1 + n) & 0xFF);
+                ((unsigned char *)p[j])[0] = (unsigned char)n;
             }
 #endif
-            n = get_next_size(n);
         }
 
-        for (int j = 0; j < MALLOC_ARRAY_SIZE; j++)
+        for (int j = 0; j < g_config.batch; j++)
         {
-            if (p[j] != NULL)
+            if (p[j] == NULL)
+            {
+                continue;
+            }
+            if (++i % LATENCY_SAMPLE_INTERVAL == 0)
+            {
+                start = now_ns();
+                a->free(p[j]);
+                add_sample(t, now_ns() - start);
+            }
+            else
             {
-                free_func(p[j]);
+                a->free(p[j]);
             }
         }
+        t->ops += 2 * g_config.batch;
     }
 }
 
-void vie_free_test(void *param, void *(*alloc_func)(size_t size), void(*free_func)(void *),
-    void * volatile * shared)
+// latency of a bulk call is spread over the blocks it moved
+void alloc_free_bulk_test(bench_thread_t *t)
+{
+    void *p[MAX_BATCH_SIZE];
+    unsigned long long start;
+    unsigned long long i = 0;
+    int got;
+    const bench_allocator_t *a = t->allocator;
+    while (!g_stop)
+    {
+        size_t n = next_size(&t->seed);
+        if (++i % LATENCY_SAMPLE_INTERVAL == 0)
+        {
+            start = now_ns();
+            got = a->alloc_bulk(n, g_config.batch, p);
+            if (got > 0)
+            {
+                add_sample(t, (now_ns() - start) / got);
+            }
+            start = now_ns();
+            a->free_bulk(got, p);
+            if (got > 0)
+            {
+                add_sample(t, (now_ns() - start) / got);
+            }
+        }
+        else
+        {
+            got = a->alloc_bulk(n, g_config.batch, p);
+            a->free_bulk(got, p);
+        }
+        t->ops += 2 * got;
+    }
+}
+
+// producers put blocks into random slots, consumers take them out.
+// a producer frees the block it displaces, so a lone producer still works.
+void vie_free_test(bench_thread_t *t)
 {
     void *v;
-    int n = INITIAL_ALLOC_SIZE;
-    int id = (long)param;
-    for (int i = 0; i < ALLOC_TIMES; i++)
+    unsigned long long start;
+    unsigned long long i = 0;
+    const bench_allocator_t *a = t->allocator;
+    while (!g_stop)
     {
-        v = InterlockedExchangePointer(shared, NULL);
-        if (v != NULL)
+        int slot = next_rand(&t->seed) % SHARED_SLOTS;
+        int timed = (++i % LATENCY_SAMPLE_INTERVAL == 0);
+        if (t->role != ROLE_CONSUMER)
         {
-            free_func(v);
+            size_t n = next_size(&t->seed);
+            start = timed ? now_ns() : 0;
+            void *p = a->alloc(n);
+            if (timed)
+            {
+                add_sample(t, now_ns() - start);
+            }
+            t->ops++;
+            v = InterlockedExchangePointer(&g_shared[slot], p);
         }
-        if (id == 0)
+        else
         {
-            void *p = alloc_func(n);
-#ifdef HAVE_ASSIGN
-            for (int j = 0; j < n; j++)
+            v = InterlockedExchangePointer(&g_shared[slot], NULL);
+        }
+        if (v != NULL)
+        {
+            start = timed ? now_ns() : 0;
+            a->free(v);
+            if (timed)
             {
-                ((unsigned char *)p)[j] = ((1 + n) & 0xFF);
+                add_sample(t, now_ns() - start);
             }
-#endif
-            InterlockedExchangePointer(shared, p);
-            n = get_next_size(n);
+            t->ops++;
         }
     }
-    v = InterlockedExchangePointer(shared, NULL);
-    if (v != NULL)
+}
+
+void *bench_thread_proc(void *param)
+{
+    bench_thread_t *t = (bench_thread_t *)param;
+    double cpu;
+    wait_event(&g_start, INFINITE);
+    cpu = thread_cpu_seconds();
+    switch (t->workload)
     {
-        free_func(v);
+    case WORKLOAD_ALLOC:
+        alloc_free_test(t);
+        break;
+    case WORKLOAD_BULK:
+        alloc_free_bulk_test(t);
+        break;
+    default:
+        vie_free_test(t);
+        break;
     }
+    t->cpu = thread_cpu_seconds() - cpu;
+    return NULL;
 }
 
-void original_alloc(void *param)
+// messages of the pool come through the kprint ring, written out here
+void print_log_record(LARGE_INTEGER *time, void *data, int length, int entry_flag, void *user_data)
 {
-    alloc_free_test(param, malloc, free);
+    FILE *out = (FILE *)user_data;
+    if (entry_flag & KPRINT_ENTRY_LOST)
+    {
+        fprintf(out, "[log records lost]\n");
+    }
+    fwrite(data, 1, length, out);
+    if (entry_flag & KPRINT_ENTRY_TRUNCATED)
+    {
+        fprintf(out, "[truncated]\n");
+    }
 }
 
-void original_vie_free(void *param)
+void *log_thread_proc(void *param)
 {
-    vie_free_test(param, malloc, free, &ori_shared);
+    while (!g_log_stop)
+    {
+        kprint_ring_wait_data();
+        kprint_ring_read(print_log_record, stdout);
+    }
+    return NULL;
 }
 
-void mem_pool_alloc(void *param)
+int compare_samples(const void *a, const void *b)
 {
-    alloc_free_test(param, mp_malloc, mp_free);
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
 }
 
-void mem_pool_vie_free(void *param)
+const char *workload_name(int workload)
 {
-    vie_free_test(param, mp_malloc, mp_free, &mp_shared);
+    switch (workload)
+    {
+    case WORKLOAD_ALLOC:
+        return "alloc";
+    case WORKLOAD_BULK:
+        return "bulk";
+    default:
+        return "vie";
+    }
 }
 
-#ifndef WIN32
-timespec diff_time(timespec end, timespec start)
+void run_bench(int workload, const bench_allocator_t *allocator, int num_threads)
 {
-    timespec temp;
-    if ((end.tv_nsec - start.tv_nsec) < 0) {
-        temp.tv_sec = end.tv_sec - start.tv_sec - 1;
-        temp.tv_nsec = 1000000000 + end.tv_nsec - start.tv_nsec;
+    thread_handle_t *hThread;
+    bench_thread_t *threads;
+    bench_result_t *r;
+    unsigned int *all;
+    unsigned int total = 0;
+    double start, end;
+
+    hThread = (thread_handle_t *)malloc(num_threads * sizeof(thread_handle_t));
+    threads = (bench_thread_t *)calloc(num_threads, sizeof(bench_thread_t));
+    for (int i = 0; i < num_threads; i++)
+    {
+        bench_thread_t *t = &threads[i];
+        t->id = i;
+        t->workload = workload;
+        t->allocator = allocator;
+        t->seed = 2463534242u + i * 7919;
+        t->samples = (unsigned int *)malloc(MAX_LATENCY_SAMPLES * sizeof(unsigned int));
+        if (num_threads == 1)
+        {
+            t->role = ROLE_BOTH;
+        }
+        else
+        {
+            t->role = (i % (g_config.producers + g_config.consumers) < g_config.producers)
+                ? ROLE_PRODUCER : ROLE_CONSUMER;
+        }
     }
-    else {
-        temp.tv_sec = end.tv_sec - start.tv_sec;
-        temp.tv_nsec = end.tv_nsec - start.tv_nsec;
+
+#ifdef MP_LATENCY_HISTOGRAM
+    if (g_config.latency && allocator == &g_pool_allocator)
+    {
+        mp_latency_reset();
     }
-    return temp;
-}
 #endif
+    reset_event(&g_start);
+    g_stop = 0;
+    for (int i = 0; i < num_threads; i++)
+    {
+        hThread[i] = create_thread(bench_thread_proc, &threads[i]);
+    }
+    start = wall_seconds();
+    set_event(&g_start);
+    sleep_seconds(g_config.seconds);
+    g_stop = 1;
+    wait_threads(hThread, num_threads);
+    end = wall_seconds();
 
-void calc_function_run_time(int thread_id, const char *func_name, void(*func)(void *), void *arg)
-{
-#ifdef WIN32
-    LARGE_INTEGER start, end;
-    LONGLONG sub;
-#else
-    timespec start, end;
-    timespec sub;
-#endif
+    for (int i = 0; i < SHARED_SLOTS; i++)
+    {
+        void *v = InterlockedExchangePointer(&g_shared[i], NULL);
+        if (v != NULL)
+        {
+            allocator->free(v);
+        }
+    }
 
-#ifdef WIN32
-    QueryPerformanceCounter(&start);
-#else
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
-#endif
-    func(arg);
-#ifdef WIN32
-    QueryPerformanceCounter(&end);
-    sub = end.QuadPart - start.QuadPart;
-    printf("thread[%d] %s: %I64u\n",
-        thread_id,
-        func_name,
-        sub);
-#else
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
-    sub = diff_time(end, start);
-    printf("thread[%d] %s: %lld.%.9ld\n",
-        thread_id,
-        func_name,
-        (long long)sub.tv_sec,
-        sub.tv_nsec);
+    r = &g_results[g_result_count++];
+    memset(r, 0, sizeof(*r));
+    r->workload = workload_name(workload);
+    r->allocator = allocator->name;
+    r->threads = num_threads;
+    r->wall = end - start;
+    for (int i = 0; i < num_threads; i++)
+    {
+        r->ops += threads[i].ops;
+        r->cpu += threads[i].cpu;
+        total += (threads[i].sample_count < MAX_LATENCY_SAMPLES)
+            ? threads[i].sample_count : MAX_LATENCY_SAMPLES;
+    }
+    r->ops_per_sec = r->ops / r->wall;
+
+    all = (unsigned int *)malloc((total + 1) * sizeof(unsigned int));
+    total = 0;
+    for (int i = 0; i < num_threads; i++)
+    {
+        unsigned int n = (threads[i].sample_count < MAX_LATENCY_SAMPLES)
+            ? threads[i].sample_count : MAX_LATENCY_SAMPLES;
+        memcpy(all + total, threads[i].samples, n * sizeof(unsigned int));
+        total += n;
+        free(threads[i].samples);
+    }
+    if (total > 0)
+    {
+        qsort(all, total, sizeof(unsigned int), compare_samples);
+        r->p50 = all[(unsigned long long)total * 50 / 100];
+        r->p90 = all[(unsigned long long)total * 90 / 100];
+        r->p99 = all[(unsigned long long)total * 99 / 100];
+        r->p999 = all[(unsigned long long)total * 999 / 1000];
+        r->max = all[total - 1];
+    }
+    free(all);
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        if (hThread[i] != (thread_handle_t)NULL)
+        {
+            close_thread_handle(hThread[i]);
+        }
+    }
+    free(threads);
+    free(hThread);
+
+    if (g_config.verbose && allocator == &g_pool_allocator)
+    {
+        mp_print();
+    }
+#ifdef MP_LATENCY_HISTOGRAM
+    else if (g_config.latency && allocator == &g_pool_allocator)
+    {
+        // through the ring like the dump, so it comes out right before it
+        kprintf("%s, %d threads:\n", workload_name(workload), num_threads);
+        mp_latency_print();
+    }
 #endif
 }
 
-void *test_original_proc(void *param)
+// ops/sec relative to malloc for the same workload and threads, 0 if malloc
+// wasn't run
+double vs_malloc(const bench_result_t *r)
 {
-    int id;
-    id = (int)(long)param;
-    calc_function_run_time(id, "original_alloc", original_alloc, (void *)(long)id);
-    return NULL;
+    for (int i = 0; i < g_result_count; i++)
+    {
+        if (strcmp(g_results[i].allocator, "malloc") == 0
+            && strcmp(g_results[i].workload, r->workload) == 0
+            && g_results[i].threads == r->threads
+            && g_results[i].ops_per_sec > 0)
+        {
+            return r->ops_per_sec / g_results[i].ops_per_sec;
+        }
+    }
+    return 0;
 }
 
-void *test_original_free_proc(void *param)
+// vs_malloc formatted with fmt, none when malloc wasn't run to compare with
+const char *vs_malloc_text(const bench_result_t *r, const char *fmt, const char *none, char *buf, size_t size)
 {
-    int id;
-    id = (int)(long)param;
-    calc_function_run_time(id, "original_vie_free", original_vie_free, (void *)(long)id);
-    return NULL;
+    double v = vs_malloc(r);
+    if (v <= 0)
+    {
+        return none;
+    }
+    snprintf(buf, size, fmt, v);
+    return buf;
 }
 
-void *test_memory_pool_proc(void *param)
+void print_results(FILE *out)
 {
-    int id;
-    id = (int)(long)param;
-    calc_function_run_time(id, "mem_pool_alloc", mem_pool_alloc, (void *)(long)id);
-    return NULL;
+    int i;
+    char vs[32];
+    const bench_result_t *r;
+    switch (g_config.output)
+    {
+    case OUTPUT_CSV:
+        fprintf(out, "workload,allocator,threads,ops,wall_s,cpu_s,ops_per_sec,"
+            "p50_ns,p90_ns,p99_ns,p999_ns,max_ns,vs_malloc\n");
+        for (i = 0; i < g_result_count; i++)
+        {
+            r = &g_results[i];
+            fprintf(out, "%s,%s,%d,%llu,%.6f,%.6f,%.0f,%u,%u,%u,%u,%u,%s\n",
+                r->workload, r->allocator, r->threads, r->ops, r->wall, r->cpu,
+                r->ops_per_sec, r->p50, r->p90, r->p99, r->p999, r->max,
+                vs_malloc_text(r, "%.3f", "", vs, sizeof(vs)));
+        }
+        break;
+    case OUTPUT_JSON:
+        fprintf(out, "[\n");
+        for (i = 0; i < g_result_count; i++)
+        {
+            r = &g_results[i];
+            fprintf(out, "  {\"workload\": \"%s\", \"allocator\": \"%s\", \"threads\": %d, "
+                "\"ops\": %llu, \"wall_s\": %.6f, \"cpu_s\": %.6f, \"ops_per_sec\": %.0f, "
+                "\"p50_ns\": %u, \"p90_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u, "
+                "\"max_ns\": %u, \"vs_malloc\": %s}%s\n",
+                r->workload, r->allocator, r->threads, r->ops, r->wall, r->cpu,
+                r->ops_per_sec, r->p50, r->p90, r->p99, r->p999, r->max,
+                vs_malloc_text(r, "%.3f", "null", vs, sizeof(vs)),
+                (i + 1 < g_result_count) ? "," : "");
+        }
+        fprintf(out, "]\n");
+        break;
+    default:
+        fprintf(out, "%-8s %-8s %7s %12s %8s %8s %12s %8s %8s %8s %8s %10s %9s\n",
+            "workload", "alloc", "threads", "ops", "wall_s", "cpu_s", "ops/sec",
+            "p50_ns", "p90_ns", "p99_ns", "p999_ns", "max_ns", "vs_malloc");
+        for (i = 0; i < g_result_count; i++)
+        {
+            r = &g_results[i];
+            fprintf(out, "%-8s %-8s %7d %12llu %8.3f %8.3f %12.0f %8u %8u %8u %8u %10u %9s\n",
+                r->workload, r->allocator, r->threads, r->ops, r->wall, r->cpu,
+                r->ops_per_sec, r->p50, r->p90, r->p99, r->p999, r->max,
+                vs_malloc_text(r, "%.2f", "-", vs, sizeof(vs)));
+        }
+        break;
+    }
 }
 
-void *test_memory_pool_free_proc(void *param)
+// a failed check is reported and counted, the rest still run
+#define CHECK(expr) \
+    do \
+    { \
+        if (!(expr)) \
+        { \
+            printf("check failed: %s, %s:%d\n", #expr, __FILE__, __LINE__); \
+            g_check_failed++; \
+        } \
+    } while (0)
+
+#define CHECK_ALIGNED(p, align) CHECK(((size_t)(p) & ((align) - 1)) == 0)
+
+struct check_object
 {
-    int id;
-    id = (int)(long)param;
-    calc_function_run_time(id, "mem_pool_vie_free", mem_pool_vie_free, (void *)(long)id);
-    return NULL;
+    long long id;
+    double value;
+    check_object(long long i, double v) : id(i), value(v) {}
+};
+
+void check_typed()
+{
+    check_object *objects[256];
+    std::vector<int, lfmp::pool_allocator<int> > v;
+    std::list<check_object, lfmp::pool_allocator<check_object> > l;
+    std::map<int, int, std::less<int>, lfmp::pool_allocator<std::pair<const int, int> > > m;
+    long long sum = 0;
+    void *p;
+
+    p = lfmp::alloc<100>();
+    CHECK(p != NULL && mp_usable_size(p) >= 100);
+    mp_free(p);
+
+    for (int i = 0; i < 256; i++)
+    {
+        objects[i] = lfmp::object_pool<check_object>::emplace(i, i * 0.5);
+        CHECK_ALIGNED(objects[i], alignof(check_object));
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        CHECK(objects[i]->id == i && objects[i]->value == i * 0.5);
+        lfmp::object_pool<check_object>::destroy(objects[i]);
+    }
+
+    // the vector grows through arrays, list and map nodes are single objects
+    for (int i = 0; i < 10000; i++)
+    {
+        v.push_back(i);
+        l.push_back(check_object(i, 0));
+        m[i] = i;
+    }
+    CHECK_ALIGNED(v.data(), alignof(int));
+    for (int i = 0; i < 10000; i++)
+    {
+        sum += v[i] - m[i];
+    }
+    CHECK(sum == 0 && l.size() == 10000 && l.back().id == 9999);
 }
 
-void test_performance(int num_threads,
-    void *(*lpStartAddress)(void *))
+// typed buckets forgotten by mp_clear register again with the next mp_init
+void check_typed_reinit()
 {
-    thread_handle_t *hThread;
-    hThread = (thread_handle_t *)malloc(num_threads * sizeof(thread_handle_t));
+    check_object *object;
+    mp_clear();
+    mp_init(g_config.usable, 65535);
+    object = lfmp::object_pool<check_object>::emplace(1, 2.0);
+    CHECK(object != NULL && object->id == 1);
+    lfmp::object_pool<check_object>::destroy(object);
+}
 
-    for (int i = 0; i < num_threads; i++)
-    {    
-        hThread[i] = create_thread(lpStartAddress, (void *)(long)i);
+int check_filled(const void *p, int c, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (((const unsigned char *)p)[i] != (unsigned char)c)
+        {
+            return 0;
+        }
     }
+    return 1;
+}
 
-    // Wait until all threads have terminated.
-    wait_threads(hThread, num_threads);
+void check_realloc()
+{
+    const size_t large = MP_SIZE_CLASS_MAX_SIZE + 1;
+    unsigned char *p, *q;
 
-    for (int i = 0; i < num_threads; i++)
+    p = (unsigned char *)mp_realloc(NULL, 100);
+    CHECK(p != NULL && mp_usable_size(p) >= 100);
+    memset(p, 0x5a, 100);
+    // stays while the size fits the block
+    CHECK(mp_realloc(p, mp_usable_size(p)) == p);
+    // a larger class, then a large block and back, contents move along
+    q = (unsigned char *)mp_realloc(p, 5000);
+    CHECK(q != NULL && mp_usable_size(q) >= 5000 && check_filled(q, 0x5a, 100));
+    memset(q, 0x5a, 5000);
+    p = (unsigned char *)mp_realloc(q, large);
+    CHECK(p != NULL && mp_usable_size(p) >= large && check_filled(p, 0x5a, 5000));
+    memset(p, 0x5a, large);
+    q = (unsigned char *)mp_realloc(p, 2 * large);
+    CHECK(q != NULL && check_filled(q, 0x5a, large));
+    // shrinking a large block below half its size moves it to a class
+    p = (unsigned char *)mp_realloc(q, 100);
+    CHECK(p != NULL && p != q && check_filled(p, 0x5a, 100));
+    CHECK(mp_realloc(p, 0) == NULL);
+
+    // blocks come back dirty, calloc clears them
+    p = (unsigned char *)mp_malloc(1000);
+    q = (unsigned char *)mp_malloc(large);
+    CHECK(p != NULL && q != NULL);
+    memset(p, 0xff, 1000);
+    memset(q, 0xff, large);
+    mp_free(p);
+    mp_free(q);
+    p = (unsigned char *)mp_calloc(100, 10);
+    q = (unsigned char *)mp_calloc(1, large);
+    CHECK(p != NULL && check_filled(p, 0, 1000));
+    CHECK(q != NULL && check_filled(q, 0, large));
+    mp_free(p);
+    mp_free(q);
+    q = (unsigned char *)mp_calloc(4, large);
+    CHECK(q != NULL && check_filled(q, 0, 4 * large));
+    mp_free(q);
+    CHECK(mp_calloc((size_t)-1 / 2, 3) == NULL);
+    CHECK(mp_calloc(3, (size_t)-1 / 2) == NULL);
+}
+
+void check_memalign()
+{
+    const size_t sizes[] = { 1, 100, 5000, MP_SIZE_CLASS_MAX_SIZE + 1 };
+    for (size_t align = 1; align <= 0x10000; align <<= 1)
     {
-        if (hThread[i] != NULL)
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
         {
-            close_thread_handle(hThread[i]);
+            void *p = mp_memalign(align, sizes[i]);
+            CHECK(p != NULL);
+            if (p != NULL)
+            {
+                CHECK_ALIGNED(p, align);
+                CHECK(mp_usable_size(p) >= sizes[i]);
+                memset(p, 0xa5, sizes[i]);
+                mp_free(p);
+            }
         }
     }
+}
 
-    free(hThread);
+// a pool of its own serves, trims and is destroyed apart from the node pools
+void check_pool()
+{
+    const size_t sizes[] = { 1, 100, 5000, MP_SIZE_CLASS_MAX_SIZE + 1 };
+    memory_pool_t *pool;
+    void *p[64];
+
+    CHECK(mp_default_pool() != NULL);
+    p[0] = mp_pool_malloc(mp_default_pool(), 100);
+    CHECK(p[0] != NULL);
+    mp_pool_free(mp_default_pool(), p[0]);
+
+    pool = mp_pool_create(0x1000000, 0);
+    CHECK(pool != NULL && pool != mp_default_pool());
+    if (pool == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        size_t size = sizes[i % 4];
+        p[i] = mp_pool_malloc(pool, size);
+        CHECK(p[i] != NULL && mp_usable_size(p[i]) >= size);
+        if (p[i] != NULL)
+        {
+            memset(p[i], i, size);
+        }
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        if (p[i] != NULL)
+        {
+            CHECK(check_filled(p[i], i, sizes[i % 4]));
+            // mp_free finds the pool by itself
+            if (i % 2 == 0)
+            {
+                mp_pool_free(pool, p[i]);
+            }
+            else
+            {
+                mp_free(p[i]);
+            }
+        }
+    }
+    CHECK(mp_pool_trim(pool, (size_t)-1) > 0);
+    mp_pool_destroy(pool);
 }
 
-void do_test(int usable_memory, int num_threads)
-{
-    printf("----------------------------------------\n");
-    printf("num_threads: %d, usable_memory: %d\n", num_threads, usable_memory);
-    mp_init(usable_memory, 65535 * num_threads);
-    printf("alloc and free test.\n");
-    test_performance(num_threads, test_memory_pool_proc);
-    test_performance(num_threads, test_original_proc);
-    test_performance(num_threads, test_memory_pool_proc);
-    mp_print();
-    printf("vie for free test.\n");
-    test_performance(num_threads, test_memory_pool_free_proc);
-    test_performance(num_threads, test_original_free_proc);
-    test_performance(num_threads, test_memory_pool_free_proc);
-    mp_print();
-    mp_clear();
-    mp_print();
+// sizes from 0 to over a quarter chunk, all aligned and apart, in an arena
+// of the node pools and one of a created pool
+void check_arena()
+{
+    static unsigned char *p[1024];
+    memory_pool_t *pool;
+    mp_arena_t *arena;
+    void *first;
+
+    pool = mp_pool_create(0x1000000, 0);
+    CHECK(pool != NULL);
+    for (int a = 0; a < 2; a++)
+    {
+        arena = mp_arena_create((a == 0) ? NULL : pool, 0);
+        CHECK(arena != NULL);
+        if (arena == NULL)
+        {
+            continue;
+        }
+        first = NULL;
+        for (int round = 0; round < 2; round++)
+        {
+            for (int i = 0; i < 1024; i++)
+            {
+                size_t size = (i % 100 == 99) ? MP_ARENA_CHUNK_SIZE / 2 : (size_t)(i * 37) % 500;
+                p[i] = (unsigned char *)mp_arena_alloc(arena, size);
+                CHECK(p[i] != NULL);
+                CHECK_ALIGNED(p[i], MP_ARENA_ALIGN);
+                // zero sizes too get an address of their own
+                CHECK(i == 0 || p[i] != p[i - 1]);
+                if (p[i] != NULL)
+                {
+                    memset(p[i], i, size);
+                }
+            }
+            for (int i = 0; i < 1024; i++)
+            {
+                size_t size = (i % 100 == 99) ? MP_ARENA_CHUNK_SIZE / 2 : (size_t)(i * 37) % 500;
+                CHECK(p[i] == NULL || check_filled(p[i], i, size));
+            }
+            // a reset starts over where the arena began
+            CHECK(first == NULL || p[0] == first);
+            first = p[0];
+            mp_arena_reset(arena);
+        }
+        CHECK(mp_arena_alloc(arena, (size_t)-1) == NULL);
+        mp_arena_destroy(arena);
+    }
+    if (pool != NULL)
+    {
+        mp_pool_destroy(pool);
+    }
+}
+
+volatile long g_check_woken = 0;
+
+void *check_event_proc(void *param)
+{
+    if (wait_event((event_t *)param, INFINITE) == WAIT_OBJECT_0)
+    {
+        InterlockedIncrement(&g_check_woken);
+    }
+    return NULL;
+}
+
+// a manual-reset event stays set for every wait, an auto-reset one is taken
+// by the first, a timed wait lasts about its timeout
+void check_event()
+{
+    event_t manual, autoreset;
+    thread_handle_t threads[4];
+    unsigned long long elapsed;
+
+    init_manual_reset_event(&manual);
+    init_event(&autoreset);
+    CHECK(wait_event(&manual, 0) == WAIT_TIMEOUT);
+    set_event(&manual);
+    CHECK(wait_event(&manual, 0) == WAIT_OBJECT_0);
+    CHECK(wait_event(&manual, 10) == WAIT_OBJECT_0);
+    reset_event(&manual);
+    CHECK(wait_event(&manual, 0) == WAIT_TIMEOUT);
+    set_event(&autoreset);
+    CHECK(wait_event(&autoreset, 0) == WAIT_OBJECT_0);
+    CHECK(wait_event(&autoreset, 0) == WAIT_TIMEOUT);
+
+    elapsed = now_ns();
+    CHECK(wait_event(&autoreset, 20) == WAIT_TIMEOUT);
+    elapsed = now_ns() - elapsed;
+    CHECK(elapsed >= 19000000ULL && elapsed < 1000000000ULL);
+
+    // one set wakes every sleeper of a manual-reset event
+    g_check_woken = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        threads[i] = create_thread(check_event_proc, &manual);
+    }
+    sleep_seconds(0.01);
+    set_event(&manual);
+    wait_threads(threads, 4);
+    CHECK(g_check_woken == 4);
+    for (int i = 0; i < 4; i++)
+    {
+        close_thread_handle(threads[i]);
+    }
+
+    // and one sleeper of an auto-reset event, the signal is gone afterwards
+    g_check_woken = 0;
+    threads[0] = create_thread(check_event_proc, &autoreset);
+    sleep_seconds(0.01);
+    set_event(&autoreset);
+    wait_thread(threads[0]);
+    close_thread_handle(threads[0]);
+    CHECK(g_check_woken == 1 && wait_event(&autoreset, 0) == WAIT_TIMEOUT);
+
+    close_event(&manual);
+    close_event(&autoreset);
+}
+
+// blocks freed to the buckets and the large cache are given back by mp_trim
+void check_trim()
+{
+    void *p[4096];
+    for (int i = 0; i < 4096; i++)
+    {
+        p[i] = mp_malloc((i % 4 == 0) ? 1000 : 3000);
+        CHECK(p[i] != NULL);
+    }
+    mp_free_bulk(4096, p);
+    p[0] = mp_malloc(0x100000);
+    CHECK(p[0] != NULL);
+    mp_free(p[0]);
+#ifdef USE_THREAD_CACHE
+    mp_thread_cache_flush();
+#endif
+    CHECK(mp_trim(0) > 0);
+    // the buckets refill after a trim
+    p[0] = mp_malloc(1000);
+    CHECK(p[0] != NULL);
+    mp_free(p[0]);
+}
+
+void run_checks()
+{
+    check_typed();
+    check_typed_reinit();
+    check_realloc();
+    check_memalign();
+    check_pool();
+    check_arena();
+    check_trim();
+    check_event();
+    printf("checks %s\n", (g_check_failed == 0) ? "passed" : "failed");
+}
+
+void usage()
+{
+    printf("usage: lfmp [-t threads[,threads...]] [-w alloc|bulk|vie|all] [-a malloc|pool|both]\n"
+        "            [-s min[:max]] [-d fixed|uniform|log] [-r producers:consumers]\n"
+        "            [-T seconds] [-b batch] [-m usable_percents] [-o table|csv|json]\n"
+        "            [-f file] [-v] [-l] [-c]\n");
+}
+
+int parse_args(int argc, char* argv[])
+{
+    bench_config_t *c = &g_config;
+    c->threads[0] = 1;
+    c->threads[1] = 4;
+    c->thread_counts = 2;
+    c->workloads = WORKLOAD_ALLOC | WORKLOAD_BULK | WORKLOAD_VIE;
+    c->allocators = ALLOCATOR_MALLOC | ALLOCATOR_POOL;
+    c->min_size = 1;
+    c->max_size = 0x7fff;
+    c->dist = DIST_UNIFORM;
+    c->producers = 1;
+    c->consumers = 1;
+    c->seconds = 1;
+    c->batch = 8;
+    c->usable = 10;
+    c->output = OUTPUT_TABLE;
+    c->file = NULL;
+    c->verbose = 0;
+    c->latency = 0;
+    c->check = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *opt = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(opt, "-v") == 0)
+        {
+            c->verbose = 1;
+            continue;
+        }
+        if (strcmp(opt, "-c") == 0)
+        {
+            c->check = 1;
+            continue;
+        }
+        if (strcmp(opt, "-l") == 0)
+        {
+#ifndef MP_LATENCY_HISTOGRAM
+            printf("-l needs a build with MP_LATENCY_HISTOGRAM\n");
+            return 0;
+#endif
+            c->latency = 1;
+            continue;
+        }
+        if (opt[0] != '-' || opt[1] == 0 || opt[2] != 0 || val == NULL)
+        {
+            return 0;
+        }
+        i++;
+        switch (opt[1])
+        {
+        case 't':
+            c->thread_counts = 0;
+            for (const char *s = val; *s != 0 && c->thread_counts < MAX_THREAD_COUNTS; )
+            {
+                c->threads[c->thread_counts++] = atoi(s);
+                s = strchr(s, ',');
+                if (s == NULL)
+                {
+                    break;
+                }
+                s++;
+            }
+            break;
+        case 'w':
+            c->workloads = (strcmp(val, "alloc") == 0) ? WORKLOAD_ALLOC
+                : (strcmp(val, "bulk") == 0) ? WORKLOAD_BULK
+                : (strcmp(val, "vie") == 0) ? WORKLOAD_VIE
+                : (strcmp(val, "all") == 0) ? (WORKLOAD_ALLOC | WORKLOAD_BULK | WORKLOAD_VIE) : 0;
+            break;
+        case 'a':
+            c->allocators = (strcmp(val, "malloc") == 0) ? ALLOCATOR_MALLOC
+                : (strcmp(val, "pool") == 0) ? ALLOCATOR_POOL
+                : (strcmp(val, "both") == 0) ? (ALLOCATOR_MALLOC | ALLOCATOR_POOL) : 0;
+            break;
+        case 's':
+            c->min_size = atoi(val);
+            c->max_size = (strchr(val, ':') != NULL) ? atoi(strchr(val, ':') + 1) : c->min_size;
+            break;
+        case 'd':
+            c->dist = (strcmp(val, "fixed") == 0) ? DIST_FIXED
+                : (strcmp(val, "log") == 0) ? DIST_LOG : DIST_UNIFORM;
+            break;
+        case 'r':
+            c->producers = atoi(val);
+            c->consumers = (strchr(val, ':') != NULL) ? atoi(strchr(val, ':') + 1) : 0;
+            break;
+        case 'T':
+            c->seconds = atof(val);
+            break;
+        case 'b':
+            c->batch = atoi(val);
+            break;
+        case 'm':
+            c->usable = atoi(val);
+            break;
+        case 'f':
+            c->file = val;
+            break;
+        case 'o':
+            c->output = (strcmp(val, "csv") == 0) ? OUTPUT_CSV
+                : (strcmp(val, "json") == 0) ? OUTPUT_JSON : OUTPUT_TABLE;
+            break;
+        default:
+            return 0;
+        }
+    }
+
+    if (c->thread_counts == 0 || c->workloads == 0 || c->allocators == 0
+        || c->min_size < 1 || c->max_size < c->min_size
+        || c->producers < 1 || c->consumers < 0
+        || c->batch < 1 || c->batch > MAX_BATCH_SIZE || c->seconds <= 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < c->thread_counts; i++)
+    {
+        if (c->threads[i] < 1)
+        {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 int main(int argc, char* argv[])
 {
-    // test with sufficient memory;
-    do_test(10, 1);
-    do_test(10, 4);
-    // test with insufficient memory;
-    do_test(0, 1);
-    do_test(0, 4);
+    int max_threads = 1;
+    thread_handle_t log_thread;
+    if (!parse_args(argc, argv))
+    {
+        usage();
+        return 1;
+    }
+    for (int i = 0; i < g_config.thread_counts; i++)
+    {
+        if (g_config.threads[i] > max_threads)
+        {
+            max_threads = g_config.threads[i];
+        }
+    }
+    if (g_config.output == OUTPUT_TABLE)
+    {
+#ifdef MP_SLIST_TAGGED
+        printf("slist: tagged head, ");
+#else
+        printf("slist: refer count, ");
+#endif
+        printf("sizes: %d-%d, batch: %d, usable_memory: %d, seconds: %.1f\n",
+            g_config.min_size, g_config.max_size, g_config.batch, g_config.usable, g_config.seconds);
+    }
+
+    init_kprint_ring();
+    log_thread = create_thread(log_thread_proc, NULL);
+    init_manual_reset_event(&g_start);
+    mp_init(g_config.usable, 65535 * max_threads);
+    for (int w = WORKLOAD_ALLOC; w <= WORKLOAD_VIE && !g_config.check; w <<= 1)
+    {
+        if (!(g_config.workloads & w))
+        {
+            continue;
+        }
+        for (int i = 0; i < g_config.thread_counts && g_result_count + 2 <= MAX_RESULTS; i++)
+        {
+            if (g_config.allocators & ALLOCATOR_MALLOC)
+            {
+                run_bench(w, &g_malloc_allocator, g_config.threads[i]);
+            }
+            if (g_config.allocators & ALLOCATOR_POOL)
+            {
+                run_bench(w, &g_pool_allocator, g_config.threads[i]);
+            }
+        }
+    }
+    if (g_config.check)
+    {
+        run_checks();
+    }
+    mp_clear();
+    close_event(&g_start);
+    // close wakes the log thread, what it left is read here
+    g_log_stop = 1;
+    kprint_ring_close();
+    wait_thread(log_thread);
+    close_thread_handle(log_thread);
+    kprint_ring_read(print_log_record, stdout);
+    if (kprint_ring_get_dropped() != 0)
+    {
+        printf("log records dropped: %ld\n", kprint_ring_get_dropped());
+    }
+    clear_kprint_ring();
+    if (g_config.check)
+    {
+        return (g_check_failed == 0) ? 0 : 1;
+    }
+
+    // the pool reports to stdout too, so machine readable output may go to a file
+    if (g_config.file != NULL)
+    {
+        FILE *out = fopen(g_config.file, "w");
+        if (out == NULL)
+        {
+            printf("can't open %s\n", g_config.file);
+            return 1;
+        }
+        print_results(out);
+        fclose(out);
+    }
+    else
+    {
+        print_results(stdout);
+    }
 	return 0;
 }
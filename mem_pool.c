@@ -3,27 +3,373 @@
 //  0: reserve for being freed.
 //  1: first malloc or in list or pop from list uniquely
 //  2: pop from list, and node is tried to access possibly by others
+// with MP_SLIST_TAGGED the refer count stays 1, ABA is defeated by the list tag.
 
 #include "mem_pool.h"
 #include <stdio.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include "interlocked_defs.h"
 #include "event.h"
 #include "mem_utils.h"
+#include "numa_defs.h"
+#include "kprint.h"
 
 #ifdef WIN32
 #include <Windows.h>
 #else
+#include <fcntl.h>
+#include <sched.h>
 #include <sys/sysinfo.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#ifdef MP_LATENCY_HISTOGRAM
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
 #endif
 
 #define MP_ENTRY_INITIAL_REFER_COUNT 1
+// pauses before a waiting thread gives its core up
+#define MP_BACKOFF_SPINS 64
+// a slot that hasn't drained yet is checked again after this
+#define MP_RECLAIM_RETRY_MSEC 1
+#define MP_COUNTER_MAX_BATCH 64
+// entries a trim takes off a bucket list per exchange
+#define MP_TRIM_BATCH 256
+#define MP_PAGE_SIZE 0x1000
 #define MP_ALIGN_SIZE (sizeof(void *)*4)
 #define MP_ENTRY_HEADER_SIZE ((sizeof(mp_entry_t) - 1)/MP_ALIGN_SIZE + 1)*MP_ALIGN_SIZE
+#define MP_ROUND_UP(x, a) ((((x) - 1)/(a) + 1)*(a))
+#define MP_SLAB_HEADER_SIZE MP_ROUND_UP(sizeof(mp_slab_t), MP_ALIGN_SIZE)
+
+#define MP_STATIC_ASSERT(cond, name) typedef char mp_static_assert_##name[(cond) ? 1 : -1]
+#define MP_LINE_ALIGNED(type, field) ((offsetof(type, field) % MP_CACHE_LINE_SIZE) == 0)
+
+MP_STATIC_ASSERT(MP_LINE_ALIGNED(mp_bucket_t, usable), usable_line);
+#ifndef MP_SLIST_TAGGED
+MP_STATIC_ASSERT(MP_LINE_ALIGNED(mp_slist_t, ref_cnt), ref_cnt_line);
+#endif
+#ifdef USE_FREE_THREAD
+MP_STATIC_ASSERT(MP_LINE_ALIGNED(mp_bucket_t, unusable), unusable_line);
+MP_STATIC_ASSERT(MP_LINE_ALIGNED(memory_pool_t, require_free), require_free_line);
+#endif
+#ifdef USE_THREAD_CACHE
+MP_STATIC_ASSERT(MP_LINE_ALIGNED(mp_bucket_t, full_magazines), depot_line);
+#endif
+MP_STATIC_ASSERT(MP_LINE_ALIGNED(mp_bucket_t, entries), entries_line);
+MP_STATIC_ASSERT(MP_LINE_ALIGNED(mp_counter_t, total), total_line);
+// neighbor buckets of pool->buckets never share a line
+MP_STATIC_ASSERT((sizeof(mp_bucket_t) % MP_CACHE_LINE_SIZE) == 0, bucket_size);
+
+#ifdef MP_HEADERLESS_SMALL
+#define MP_PAGEMAP_CHUNK_SHIFT  16
+#define MP_PAGEMAP_LEAF_BITS    16
+#define MP_PAGEMAP_ROOT_BITS    16
+
+// 64K chunk -> slab, for the 48 bits user address space
+static mp_slab_t ** volatile g_pagemap[1 << MP_PAGEMAP_ROOT_BITS];
+
+#define MP_PAGEMAP_ROOT(a) (((unsigned long long)(size_t)(a) >> (MP_PAGEMAP_CHUNK_SHIFT + MP_PAGEMAP_LEAF_BITS)) \
+    & ((1 << MP_PAGEMAP_ROOT_BITS) - 1))
+#define MP_PAGEMAP_LEAF(a) (((size_t)(a) >> MP_PAGEMAP_CHUNK_SHIFT) & ((1 << MP_PAGEMAP_LEAF_BITS) - 1))
+#define MP_ENTRY_SLAB(entry) mp_pagemap_lookup(entry)
+#define MP_ENTRY_UNSHARED(entry) 1
+#else
+#define MP_ENTRY_SLAB(entry) ((entry)->slab)
+#ifdef MP_SLIST_TAGGED
+#define MP_ENTRY_UNSHARED(entry) 1
+#else
+#define MP_ENTRY_UNSHARED(entry) ((entry)->ref_cnt == MP_ENTRY_INITIAL_REFER_COUNT)
+#endif
+#endif
+
+#ifdef USE_REMOTE_FREE
+#ifdef MP_HEADERLESS_SMALL
+#define MP_ENTRY_OWNER(bucket, entry) (((bucket)->header_size != 0) ? (entry)->owner : 0)
+#define MP_ENTRY_SET_OWNER(bucket, entry, id) \
+    do { if ((bucket)->header_size != 0) (entry)->owner = (id); } while (0)
+#else
+#define MP_ENTRY_OWNER(bucket, entry) ((entry)->owner)
+#define MP_ENTRY_SET_OWNER(bucket, entry, id) ((entry)->owner = (id))
+#endif
+#else
+#define MP_ENTRY_SET_OWNER(bucket, entry, id)
+#endif
+
+memory_pool_t g_memory_pools[MP_POOL_NODES_NUMBER];
+int g_memory_pool_count = 1;
+// the pools of mp_malloc, as opposed to those of mp_pool_create
+#define MP_NODE_POOL(pool) ((size_t)(pool) - (size_t)g_memory_pools < sizeof(g_memory_pools))
+
+#ifdef USE_THREAD_CACHE
+typedef struct
+{
+    mp_magazine_t *loaded;
+    mp_magazine_t *previous;
+#ifdef USE_REMOTE_FREE
+    mp_entry_t *local;          // taken from the remote queue, served before the depot
+    // frees of blocks of another owner, handed over MP_OWNER_BATCH_SIZE at once
+    mp_entry_t *batch_first;
+    mp_entry_t *batch_last;
+    int batch_owner;
+    int batch_count;
+#endif
+} mp_cache_bucket_t;
+
+#ifdef USE_REMOTE_FREE
+#define MP_MAX_OWNERS       1024
+#define MP_OWNER_BATCH_SIZE MP_MAGAZINE_SIZE
+// a closed queue takes no more pushes
+#define MP_OWNER_CLOSED     ((mp_entry_t *)1)
+
+// remote frees for the thread cache holding it, a queue per bucket: others
+// push, the owner takes the whole queue with one exchange, so there's no
+// ABA. Records are reused by later threads and freed by mp_clear only, a
+// late push into the record of an exited thread finds its queue closed.
+typedef struct
+{
+    volatile int used;
+    mp_entry_t * volatile remote[MEMORY_POOL_BUCKETS_NUMBER];
+} mp_owner_t;
+
+static mp_owner_t * volatile g_owners[MP_MAX_OWNERS + 1];   // by id, 0 is none
+static volatile int g_owner_count = 0;
+#endif
+
+#ifdef USE_NUMA_POOLS
+#define MP_REMOTE_BATCH_SIZE MP_MAGAZINE_SIZE
+
+// frees of another node's entries, spliced into their home bucket at once
+typedef struct
+{
+    mp_entry_t *first;
+    mp_entry_t *last;
+    int count;
+} mp_remote_batch_t;
+#endif
+
+typedef struct
+{
+    memory_pool_t *pool;
+    mp_cache_bucket_t buckets[MEMORY_POOL_BUCKETS_NUMBER];
+#ifdef USE_NUMA_POOLS
+    mp_remote_batch_t *remote;  // [node][bucket], allocated on first remote free
+#endif
+#ifdef USE_REMOTE_FREE
+    mp_owner_t *owner;
+    int owner_id;
+#endif
+} mp_thread_cache_t;
+
+static THREAD_LOCAL mp_thread_cache_t *t_thread_cache = NULL;
+static tls_key_t g_thread_cache_key;
+#endif
+
+#ifdef MP_LATENCY_HISTOGRAM
+// histograms of one thread, listed until mp_clear. The record of an exited
+// thread is folded into g_latency_exited and handed to the next new thread.
+typedef struct _mp_thread_latency
+{
+    struct _mp_thread_latency *next;
+    volatile int exited;
+    int id;
+    unsigned int countdown[MP_LATENCY_OPS];
+    mp_histogram_t ops[MP_LATENCY_OPS];
+} mp_thread_latency_t;
+
+static THREAD_LOCAL mp_thread_latency_t *t_latency = NULL;
+static tls_key_t g_latency_key;
+static mp_thread_latency_t * volatile g_latency_threads = NULL;
+static volatile int g_latency_thread_ids = 0;
+static mp_histogram_t g_latency_exited[MP_LATENCY_OPS];
+#endif
+
+static __inline memory_pool_t *mp_local_pool()
+{
+#ifdef USE_NUMA_POOLS
+    if (g_memory_pool_count > 1)
+    {
+        return &g_memory_pools[get_current_numa_node() % g_memory_pool_count];
+    }
+#endif
+    return &g_memory_pools[0];
+}
+
+static THREAD_LOCAL int t_counter_shard = -1;
+static volatile int g_counter_shard_next = 0;
+
+static __inline int mp_counter_shard_index()
+{
+    int cpu;
+    if (t_counter_shard < 0)
+    {
+        cpu = get_current_cpu();
+        if (cpu < 0)
+        {
+            cpu = InterlockedIncrement(&g_counter_shard_next);
+        }
+        t_counter_shard = cpu % MP_COUNTER_SHARDS;
+    }
+    return t_counter_shard;
+}
+
+void mp_counter_init(mp_counter_t *counter, int batch)
+{
+    memset(counter, 0, sizeof(mp_counter_t));
+    counter->batch = (batch > 0) ? batch : 1;
+}
+
+static __inline void mp_counter_add(mp_counter_t *counter, int v)
+{
+    int n;
+    mp_counter_shard_t *shard;
+    shard = &counter->shard[mp_counter_shard_index()];
+    n = InterlockedAdd(&shard->value, v);
+    if (n >= counter->batch || n <= -counter->batch)
+    {
+        n = InterlockedExchange(&shard->value, 0);
+        InterlockedAdd(&counter->total, n);
+    }
+}
+
+// cheap and approximate, what the threshold checks use
+#define mp_counter_read(counter) ((counter)->total)
+
+int mp_counter_sum(mp_counter_t *counter)
+{
+    int i;
+    int sum;
+    sum = counter->total;
+    for (i = 0; i < MP_COUNTER_SHARDS; i++)
+    {
+        sum += counter->shard[i].value;
+    }
+    return sum;
+}
+
+#ifdef MP_SLIST_TAGGED
+// compare {next, tag} of li with comparand, on failure comparand is reloaded.
+static __inline int mp_slist_cas(mp_slist_t *li, mp_slist_t *comparand, mp_entry_t *next, size_t tag)
+{
+#if MP_SLIST_ALIGN == 16
+    return InterlockedCompareExchange128((long long volatile *)li,
+        (long long)tag,
+        (long long)next,
+        (long long *)comparand);
+#else
+    long long exchange;
+    long long prev;
+    mp_slist_t value;
+    value.next = next;
+    value.tag = tag;
+    exchange = *(long long *)&value;
+    prev = InterlockedCompareExchange64((long long volatile *)li, exchange, *(long long *)comparand);
+    if (prev == *(long long *)comparand)
+    {
+        return 1;
+    }
+    *(long long *)comparand = prev;
+    return 0;
+#endif
+}
+
+void mp_slist_push(mp_slist_t *li, mp_entry_t *entry)
+{
+    mp_slist_t old;
+    old.next = li->next;
+    old.tag = li->tag;
+    do {
+        entry->next = old.next;
+    } while (!mp_slist_cas(li, &old, entry, old.tag));
+}
+
+void mp_slist_push_chain(mp_slist_t *li, mp_entry_t *first, mp_entry_t *last)
+{
+    mp_slist_t old;
+    old.next = li->next;
+    old.tag = li->tag;
+    do {
+        last->next = old.next;
+    } while (!mp_slist_cas(li, &old, first, old.tag));
+}
+
+mp_entry_t *mp_slist_pop(mp_slist_t *li)
+{
+    mp_slist_t old;
+    old.next = li->next;
+    old.tag = li->tag;
+    while (old.next != NULL)
+    {
+        // old.next may be released meanwhile, a stale read fails the CAS.
+        if (mp_slist_cas(li, &old, old.next->next, old.tag + 1))
+        {
+            return old.next;
+        }
+    }
+    return NULL;
+}
+
+mp_entry_t *mp_slist_flush(mp_slist_t *li)
+{
+    mp_slist_t old;
+    old.next = li->next;
+    old.tag = li->tag;
+    while (old.next != NULL)
+    {
+        if (mp_slist_cas(li, &old, NULL, old.tag + 1))
+        {
+            break;
+        }
+    }
+    return old.next;
+}
 
-memory_pool_t g_memory_pool;
+// put back the rest of a flushed chain, the flush bumped the tag so no pop
+// can still act on what it read from the chain.
+void mp_slist_push_back(mp_slist_t *li, mp_entry_t *first)
+{
+    mp_slist_t old;
+    mp_entry_t *last;
+    old.next = NULL;
+    old.tag = li->tag;
+    if (mp_slist_cas(li, &old, first, old.tag))
+    {
+        return;
+    }
+    for (last = first; last->next != NULL; last = last->next);
+    mp_slist_push_chain(li, first, last);
+}
 
+int mp_slist_pop_bulk(mp_slist_t *li, int n, mp_entry_t **entries)
+{
+    int i;
+    mp_entry_t *first;
+    if (li->next == NULL)
+    {
+        return 0;
+    }
+    first = mp_slist_flush(li);
+    for (i = 0; i < n && first != NULL; i++)
+    {
+        entries[i] = first;
+        first = first->next;
+    }
+    if (first != NULL)
+    {
+        mp_slist_push_back(li, first);
+    }
+    return i;
+}
+#else
 void mp_slist_push(mp_slist_t *li, mp_entry_t *entry)
 {
     mp_entry_t *first;
@@ -39,10 +385,42 @@ void mp_slist_push(mp_slist_t *li, mp_entry_t *entry)
     }
 }
 
+void mp_slist_push_chain(mp_slist_t *li, mp_entry_t *first, mp_entry_t *last)
+{
+    mp_entry_t *head;
+    for (;;) {
+        head = li->next;
+        last->next = head;
+        if (head == InterlockedCompareExchangePointer(&li->next,
+            first,
+            head))
+        {
+            break;
+        }
+    }
+}
+
+static __inline int mp_slist_enter(mp_slist_t *li)
+{
+    int slot;
+    slot = li->epoch & 1;
+    InterlockedIncrement(&li->ref_cnt[slot]);
+    return slot;
+}
+
+// returns the number of pops still inside li
+static __inline int mp_slist_leave(mp_slist_t *li, int slot)
+{
+    return InterlockedDecrement(&li->ref_cnt[slot]) + li->ref_cnt[slot ^ 1];
+}
+
+#define mp_slist_quiescent(li) ((li)->ref_cnt[0] == 0 && (li)->ref_cnt[1] == 0)
+
 mp_entry_t *mp_slist_pop(mp_slist_t *li)
 {
     int done;
     int li_rc;
+    int slot;
     mp_entry_t *first;
     mp_entry_t *next;
     done = 0;
@@ -53,7 +431,7 @@ mp_entry_t *mp_slist_pop(mp_slist_t *li)
         {
             break;
         }
-        InterlockedIncrement(&li->ref_cnt); // avoid the following first entry is freed from memory
+        slot = mp_slist_enter(li); // avoid the following first entry is freed from memory
         if (first == li->next)
         {
             // avoid first entry is original first, but first->next isn't
@@ -83,7 +461,7 @@ mp_entry_t *mp_slist_pop(mp_slist_t *li)
                 }
             }
         }
-        li_rc = InterlockedDecrement(&li->ref_cnt);
+        li_rc = mp_slist_leave(li, slot);
         if (done != 0)
         {
             if (li_rc == 0)
@@ -97,197 +475,2371 @@ mp_entry_t *mp_slist_pop(mp_slist_t *li)
     return first;
 }
 
-int mp_lookup_bucket(unsigned int size)
+mp_entry_t *mp_slist_flush(mp_slist_t *li)
+{
+    return InterlockedExchangePointer(&li->next, NULL);
+}
+
+// a reader preempted while it holds a reference is only waited for with
+// the core handed over to it
+static __inline void mp_backoff(int *spins)
 {
-    int idx = 0;
-    if (size >= 1)
+    if (++*spins < MP_BACKOFF_SPINS)
     {
-        size--;
+        YieldProcessor();
     }
-    while (size > 0)
+    else
     {
-        size = size >> 1;
-        idx++;
+#ifdef WIN32
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
     }
-    return idx;
 }
 
-void mp_slist_init(mp_slist_t *li)
+// put back the rest of a flushed chain. next fields are left alone when the
+// list is still empty, otherwise the tail is linked once no pop holds it.
+void mp_slist_push_back(mp_slist_t *li, mp_entry_t *first)
 {
-    li->ref_cnt = 0;
-    li->next = NULL;
+    int spins;
+    mp_entry_t *last;
+    if (NULL == InterlockedCompareExchangePointer(&li->next, first, NULL))
+    {
+        return;
+    }
+    for (last = first; last->next != NULL; last = last->next);
+    spins = 0;
+    while (last->ref_cnt != MP_ENTRY_INITIAL_REFER_COUNT)
+    {
+        mp_backoff(&spins);
+    }
+    mp_slist_push_chain(li, first, last);
 }
 
-int mp_slist_clear(mp_bucket_t *bucket, mp_slist_t *li)
+// detaches up to n entries with one exchange, each taken entry is referred
+// the same way mp_slist_pop refers the one it takes.
+int mp_slist_pop_bulk(mp_slist_t *li, int n, mp_entry_t **entries)
 {
-    int n;
+    int i;
+    int j;
+    int slot;
     mp_entry_t *first;
-    mp_entry_t *next;
+    if (li->next == NULL)
+    {
+        return 0;
+    }
+    slot = mp_slist_enter(li);
     first = InterlockedExchangePointer(&li->next, NULL);
-    while (li->ref_cnt != 0); // safe for free
-    n = 0;
-    while (first != NULL)
+    for (i = 0; i < n && first != NULL; i++)
     {
-        next = first->next;
-        InterlockedDecrement(&bucket->entries);
-        memory_free(first);
-        first = next;
+        InterlockedIncrement(&first->ref_cnt);
+        entries[i] = first;
+        first = first->next;
     }
-    return n;
+    if (mp_slist_leave(li, slot) == 0)
+    {
+        for (j = 0; j < i; j++)
+        {
+            InterlockedDecrement(&entries[j]->ref_cnt);
+        }
+    }
+    if (first != NULL)
+    {
+        mp_slist_push_back(li, first);
+    }
+    return i;
 }
+#endif
 
-void mp_bucket_init(mp_bucket_t *bucket, 
-    int block_size, 
-    unsigned int threshold)
+static const unsigned char g_small_size_classes[(1 << (MP_SIZE_CLASS_POW2_NUMBER - 1)) + 1] =
 {
-    mp_slist_init(&bucket->usable);
-    mp_slist_init(&bucket->unusable);
-    bucket->entries = 0;
-    bucket->block_size = block_size;
-    bucket->threshold = threshold;
-	bucket->next = NULL;
-}
+    0, 0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4
+};
 
-void mp_bucket_clear(mp_bucket_t *bucket)
+static __inline int mp_log2(unsigned int v)
 {
-    mp_slist_clear(bucket, &bucket->usable);
-    mp_slist_clear(bucket, &bucket->unusable);
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanReverse(&idx, v);
+    return (int)idx;
+#else
+    return 31 - __builtin_clz(v);
+#endif
 }
 
-void *mp_bucket_malloc(mp_bucket_t *bucket, size_t size, unsigned long tag)
+// returns MEMORY_POOL_BUCKETS_NUMBER when size is beyond the biggest class
+int mp_lookup_bucket(unsigned int size)
 {
-    int block_size;
-    mp_entry_t *entry;
-	if (bucket == NULL)
-	{
-		int idx = mp_lookup_bucket(size);
-		bucket = &g_memory_pool.buckets[idx];
-	}
-    block_size = bucket->block_size;
-	if (size > (size_t)block_size)
-	{
-		return NULL;
-	}
-    entry = mp_slist_pop(&bucket->usable);
-    if (entry == NULL)
+    int lg;
+    int idx;
+    if (size <= (1 << (MP_SIZE_CLASS_POW2_NUMBER - 1)))
     {
-		entry = memory_alloc(MP_ENTRY_HEADER_SIZE + block_size, tag);
-        if (entry == NULL)
-        {
-            return NULL;
-        }
-        ((mp_entry_t *)entry)->size = block_size;
-        ((mp_entry_t *)entry)->ref_cnt = MP_ENTRY_INITIAL_REFER_COUNT;
-        ((mp_entry_t *)entry)->owned = 1;
+        return g_small_size_classes[size];
+    }
+    lg = mp_log2(size - 1);
+    idx = MP_SIZE_CLASS_POW2_NUMBER
+        + ((lg - (MP_SIZE_CLASS_POW2_NUMBER - 1)) << MP_SIZE_CLASS_GROUP_LG)
+        + (int)((size - 1) >> (lg - MP_SIZE_CLASS_GROUP_LG))
+        - (1 << MP_SIZE_CLASS_GROUP_LG);
+    return (idx < MEMORY_POOL_BUCKETS_NUMBER) ? idx : MEMORY_POOL_BUCKETS_NUMBER;
+}
 
-        InterlockedIncrement(&bucket->entries);
+unsigned int mp_bucket_block_size(int idx)
+{
+    int lg;
+    int sub;
+    if (idx < MP_SIZE_CLASS_POW2_NUMBER)
+    {
+        return 1u << idx;
     }
+    idx -= MP_SIZE_CLASS_POW2_NUMBER;
+    lg = (MP_SIZE_CLASS_POW2_NUMBER - 1) + (idx >> MP_SIZE_CLASS_GROUP_LG);
+    sub = (idx & ((1 << MP_SIZE_CLASS_GROUP_LG) - 1)) + 1;
+    return (1u << lg) + ((unsigned int)sub << (lg - MP_SIZE_CLASS_GROUP_LG));
+}
 
-	return (void *)((unsigned char *)entry + MP_ENTRY_HEADER_SIZE);
+void mp_slist_init(mp_slist_t *li)
+{
+#ifdef MP_SLIST_TAGGED
+    li->tag = 0;
+#else
+    li->ref_cnt[0] = 0;
+    li->ref_cnt[1] = 0;
+    li->epoch = 0;
+#endif
+    li->next = NULL;
 }
 
-void mp_bucket_free_entry(mp_bucket_t *bucket, mp_entry_t *entry)
+#ifdef MP_HEADERLESS_SMALL
+static __inline mp_slab_t *mp_pagemap_lookup(void *p)
 {
-    assert(entry->ref_cnt >= MP_ENTRY_INITIAL_REFER_COUNT);
-    if (entry->size * (bucket->entries + 1) > bucket->threshold)
+    return g_pagemap[MP_PAGEMAP_ROOT(p)][MP_PAGEMAP_LEAF(p)];
+}
+
+int mp_pagemap_set(mp_slab_t *slab, mp_slab_t *value)
+{
+    unsigned char *chunk;
+    mp_slab_t **leaf;
+    size_t leaf_size;
+    leaf_size = sizeof(mp_slab_t *) << MP_PAGEMAP_LEAF_BITS;
+    for (chunk = (unsigned char *)slab; 
+        chunk < (unsigned char *)slab + slab->size; 
+        chunk += (size_t)1 << MP_PAGEMAP_CHUNK_SHIFT)
     {
-        if (entry->ref_cnt == MP_ENTRY_INITIAL_REFER_COUNT)
+        leaf = g_pagemap[MP_PAGEMAP_ROOT(chunk)];
+        if (leaf == NULL)
         {
-            InterlockedDecrement(&bucket->entries);
-			memory_free(entry);
-        }
-        else
-        {
-#ifdef USE_FREE_THREAD
-            if (bucket->usable.ref_cnt == 0)
+            leaf = page_alloc(leaf_size, 'mmfl');
+            if (leaf == NULL)
             {
-                InterlockedDecrement(&bucket->entries);
-                memory_free(entry);
+                return 0;
             }
-            else
-            {
-                mp_slist_push(&bucket->unusable, entry);
-                InterlockedExchange(&g_memory_pool.require_free, 1);
-            }
-#else
-            while (bucket->usable.ref_cnt != 0); // safe for free
-            InterlockedDecrement(&bucket->entries);
-			memory_free(entry);
-#endif
-        }
-    }
-    else
-    {
-        if (entry->ref_cnt == MP_ENTRY_INITIAL_REFER_COUNT)
-        {
-            mp_slist_push(&bucket->usable, entry);
-        }
-        else
-        {
-            InterlockedExchange(&entry->owned, 0);
-            InterlockedIncrement(&bucket->usable.ref_cnt);
-            if (MP_ENTRY_INITIAL_REFER_COUNT == InterlockedDecrement(&entry->ref_cnt))
+            if (NULL != InterlockedCompareExchangePointer(&g_pagemap[MP_PAGEMAP_ROOT(chunk)],
+                leaf,
+                NULL))
             {
-                if (InterlockedCompareExchange(&entry->owned, 1, 0) == 0)
-                {
-                    mp_slist_push(&bucket->usable, entry);
-                }
+                page_free(leaf, leaf_size, 'mmfl');
+                leaf = g_pagemap[MP_PAGEMAP_ROOT(chunk)];
             }
-            InterlockedDecrement(&bucket->usable.ref_cnt);
         }
+        leaf[MP_PAGEMAP_LEAF(chunk)] = value;
     }
+    return 1;
 }
 
-void mp_bucket_free(mp_bucket_t *bucket, void *p)
+// whether p points into a slab of the pools, any pointer may be asked
+int mp_block_owned(void *p)
 {
-	mp_entry_t *entry;
-	entry = (mp_entry_t *)((unsigned char *)p - MP_ENTRY_HEADER_SIZE);
-	if (bucket == NULL)
-	{
-		int idx = mp_lookup_bucket(entry->size);
-		bucket = &g_memory_pool.buckets[idx];
-	}
-	mp_bucket_free_entry(bucket, entry);
+    mp_slab_t **leaf;
+    leaf = g_pagemap[MP_PAGEMAP_ROOT(p)];
+    return leaf != NULL && leaf[MP_PAGEMAP_LEAF(p)] != NULL;
 }
 
-void *free_thread_proc(void *param)
+void mp_pagemap_clear()
 {
-    mp_entry_t *first;
-    mp_entry_t *next;
     int i;
-    for (;;)
+    for (i = 0; i < (1 << MP_PAGEMAP_ROOT_BITS); i++)
     {
-        while (0 != g_memory_pool.require_free)
-        {
-            InterlockedExchange(&g_memory_pool.require_free, 0);
-
-            for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
-            {
-                first = InterlockedExchangePointer(&g_memory_pool.buckets[i].unusable.next, NULL);
-                if (first != NULL)
-                {
-                    while (g_memory_pool.buckets[i].usable.ref_cnt != 0);
-                    while (first != NULL)
-                    {
-                        next = first->next;
-                        InterlockedDecrement(&g_memory_pool.buckets[i].entries);
-                        free(first);
-                        first = next;
-                    }
-                }
-            }
-        }
-
-        if (WAIT_TIMEOUT != wait_event(&g_memory_pool.termin_event, 1000))
+        if (g_pagemap[i] != NULL)
         {
-            break;
+            page_free(g_pagemap[i], sizeof(mp_slab_t *) << MP_PAGEMAP_LEAF_BITS, 'mmfl');
+            g_pagemap[i] = NULL;
         }
     }
-    printf("memory pool free thread exited.\n");
-    return 0;
 }
+#endif
 
-#ifdef WIN32
+void mp_slab_unmap(mp_slab_t *slab)
+{
+#ifdef MP_HEADERLESS_SMALL
+    mp_pagemap_set(slab, NULL);
+#endif
+    page_free(slab, slab->size, slab->tag);
+}
+
+void mp_slab_list_push(mp_slab_t * volatile *head, mp_slab_t *first, mp_slab_t *last)
+{
+    mp_slab_t *old;
+    for (;;) {
+        old = *head;
+        last->next = old;
+        if (old == InterlockedCompareExchangePointer(head,
+            first,
+            old))
+        {
+            break;
+        }
+    }
+}
+
+// takes the first slab of min_size to max_size bytes off the list. The list
+// is detached with one exchange, so it's free of ABA, the rest is pushed back.
+mp_slab_t *mp_slab_list_take(mp_slab_t * volatile *head, size_t min_size, size_t max_size)
+{
+    mp_slab_t *list;
+    mp_slab_t *slab;
+    mp_slab_t **prev;
+    mp_slab_t *last;
+    if (*head == NULL)
+    {
+        return NULL;
+    }
+    list = InterlockedExchangePointer(head, NULL);
+    slab = NULL;
+    for (prev = &list; *prev != NULL; prev = &(*prev)->next)
+    {
+        if ((*prev)->size >= min_size && (*prev)->size <= max_size)
+        {
+            slab = *prev;
+            *prev = slab->next;
+            break;
+        }
+    }
+    if (list != NULL)
+    {
+        for (last = list; last->next != NULL; last = last->next);
+        mp_slab_list_push(head, list, last);
+    }
+    return slab;
+}
+
+// entry must be out of any list and no longer read by a pop
+void mp_bucket_release_entry(mp_bucket_t *bucket, mp_entry_t *entry)
+{
+    mp_slab_t *slab;
+    int blocks;
+    slab = MP_ENTRY_SLAB(entry);
+    // once retired is incremented the last retirer may unmap the slab
+    blocks = (int)slab->blocks;
+    mp_counter_add(&bucket->entries, -1);
+    if (InterlockedIncrement(&slab->retired) == blocks)
+    {
+        InterlockedDecrement(&bucket->slabs);
+#ifdef MP_SLIST_TAGGED
+        // stale pops only read next fields, zero pages are as good
+        if (slab->size > MP_PAGE_SIZE)
+        {
+            page_reset((unsigned char *)slab + MP_PAGE_SIZE, slab->size - MP_PAGE_SIZE);
+        }
+        mp_slab_list_push(&bucket->pool->drained_slabs, slab, slab);
+#else
+        mp_slab_unmap(slab);
+#endif
+    }
+}
+
+#ifdef MP_SLIST_TAGGED
+// slabs drained unused for a whole MP_DRAINED_GRACE_MSEC are unmapped, a pop
+// that read a list head before the slab drained can't still be reading it
+#define MP_DRAINED_GRACE_MSEC 1000
+
+// takes a drained slab of size to half as large again bytes, like a large
+// block from the cache. Stale pops only read the memory, so it may be carved
+// for any bucket.
+static mp_slab_t *mp_pool_reuse_slab(memory_pool_t *pool, size_t size)
+{
+    mp_slab_t *slab;
+    slab = mp_slab_list_take(&pool->drained_slabs, size, size + size / 2);
+    if (slab == NULL)
+    {
+        slab = mp_slab_list_take(&pool->idle_slabs, size, size + size / 2);
+    }
+    return slab;
+}
+#endif
+
+// a large block is a slab of one entry without bucket
+#define MP_SLAB_LARGE(slab) ((slab)->bucket == NULL)
+#define MP_LARGE_HEADER_SIZE (MP_SLAB_HEADER_SIZE + MP_ENTRY_HEADER_SIZE)
+#define MP_LARGE_CACHE_UNITS (MP_LARGE_CACHE_SIZE / PAGE_ALLOC_GRANULARITY)
+
+// *zeroed, if given, tells whether the block is a fresh mapping still
+// filled with zeros
+void *mp_large_malloc(memory_pool_t *pool, size_t size, unsigned long tag, int *zeroed)
+{
+    int huge;
+    size_t map_size;
+    mp_slab_t *slab;
+    mp_entry_t *entry;
+    if (size > (size_t)-1 - MP_LARGE_HEADER_SIZE - PAGE_HUGE_SIZE)
+    {
+        return NULL;
+    }
+    map_size = MP_LARGE_HEADER_SIZE + size;
+    huge = (MP_LARGE_HUGE_PAGES != 0 && map_size >= PAGE_HUGE_SIZE);
+    map_size = MP_ROUND_UP(map_size, huge ? PAGE_HUGE_SIZE : PAGE_ALLOC_GRANULARITY);
+    // a cached mapping may be up to half as large again
+    slab = mp_slab_list_take(&pool->large_cache, map_size, map_size + map_size / 2);
+    if (zeroed != NULL)
+    {
+#ifdef NDIS_WDM
+        // kernel pool memory comes uncleared
+        *zeroed = 0;
+#else
+        *zeroed = (slab == NULL);
+#endif
+    }
+    if (slab != NULL)
+    {
+        InterlockedAdd(&pool->large_cached, -(int)(slab->size / PAGE_ALLOC_GRANULARITY));
+    }
+    else
+    {
+        if (huge)
+        {
+            slab = page_alloc_huge(map_size, 
+                (g_memory_pool_count > 1) ? pool->node : -1, 
+                MP_LARGE_HUGE_PAGES > 1, 
+                tag);
+        }
+        else
+        {
+            slab = page_alloc_node(map_size, 
+                (g_memory_pool_count > 1) ? pool->node : -1, 
+                tag);
+        }
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        slab->size = map_size;
+        slab->tag = tag;
+        slab->bucket = NULL;
+#ifdef MP_HEADERLESS_SMALL
+        if (!mp_pagemap_set(slab, slab))
+        {
+            mp_slab_unmap(slab);
+            return NULL;
+        }
+#endif
+    }
+    slab->next = NULL;
+    slab->pool = pool;
+    slab->blocks = 1;
+    slab->retired = 0;
+    entry = (mp_entry_t *)((unsigned char *)slab + MP_SLAB_HEADER_SIZE);
+    entry->slab = slab;
+    entry->size = (size > 0xffffffff) ? 0xffffffff : (unsigned int)size;
+    entry->ref_cnt = MP_ENTRY_INITIAL_REFER_COUNT;
+    entry->owned = 1;
+    return (unsigned char *)entry + MP_ENTRY_HEADER_SIZE;
+}
+
+// unmaps the oldest cached large blocks, half of them (rounded up) for
+// decay, otherwise at least bytes
+static size_t mp_large_cache_trim(memory_pool_t *pool, int decay, size_t bytes)
+{
+    int i;
+    int n;
+    size_t total;
+    size_t kept;
+    size_t released;
+    mp_slab_t *list;
+    mp_slab_t *slab;
+    mp_slab_t *next;
+    mp_slab_t **prev;
+    list = InterlockedExchangePointer(&pool->large_cache, NULL);
+    n = 0;
+    total = 0;
+    for (slab = list; slab != NULL; slab = slab->next)
+    {
+        n++;
+        total += slab->size;
+    }
+    // newest first, keep the longest head whose tail still covers bytes
+    kept = 0;
+    for (i = 0, prev = &list; *prev != NULL; i++, prev = &(*prev)->next)
+    {
+        if ((decay != 0) ? (i >= n / 2) : (total - kept - (*prev)->size < bytes))
+        {
+            break;
+        }
+        kept += (*prev)->size;
+    }
+    released = 0;
+    slab = *prev;
+    while (slab != NULL)
+    {
+        next = slab->next;
+        InterlockedAdd(&pool->large_cached, -(int)(slab->size / PAGE_ALLOC_GRANULARITY));
+        released += slab->size;
+        mp_slab_unmap(slab);
+        slab = next;
+    }
+    *prev = slab;
+    if (list != NULL)
+    {
+        for (slab = list; slab->next != NULL; slab = slab->next);
+        mp_slab_list_push(&pool->large_cache, list, slab);
+    }
+    return released;
+}
+
+void mp_large_free(mp_slab_t *slab)
+{
+    memory_pool_t *pool;
+    int units;
+    pool = slab->pool;
+    units = (int)(slab->size / PAGE_ALLOC_GRANULARITY);
+    if (units > MP_LARGE_CACHE_UNITS)
+    {
+        mp_slab_unmap(slab);
+        return;
+    }
+    // make room by unmapping the oldest ones, the check and the add race,
+    // so the cache may overshoot by a few blocks
+    if (units > MP_LARGE_CACHE_UNITS - pool->large_cached)
+    {
+        mp_large_cache_trim(pool, 
+            0, 
+            (size_t)(units - (MP_LARGE_CACHE_UNITS - pool->large_cached)) * PAGE_ALLOC_GRANULARITY);
+    }
+    InterlockedAdd(&pool->large_cached, units);
+    mp_slab_list_push(&pool->large_cache, slab, slab);
+}
+
+void mp_entry_chain_release(mp_bucket_t *bucket, mp_entry_t *first)
+{
+    mp_entry_t *next;
+    while (first != NULL)
+    {
+        next = first->next;
+        mp_bucket_release_entry(bucket, first);
+        first = next;
+    }
+}
+
+int mp_slist_clear(mp_bucket_t *bucket, mp_slist_t *li)
+{
+    int n;
+    mp_entry_t *first;
+    mp_entry_t *next;
+    first = mp_slist_flush(li);
+#ifndef MP_SLIST_TAGGED
+    while (!mp_slist_quiescent(li)); // safe for free
+#endif
+    n = 0;
+    while (first != NULL)
+    {
+        next = first->next;
+        mp_bucket_release_entry(bucket, first);
+        first = next;
+    }
+    return n;
+}
+
+#ifdef USE_THREAD_CACHE
+void mp_depot_push(mp_magazine_t * volatile *depot, mp_magazine_t *mag)
+{
+    mp_magazine_t *first;
+    for (;;) {
+        first = *depot;
+        mag->next = first;
+        if (first == InterlockedCompareExchangePointer(depot,
+            mag,
+            first))
+        {
+            break;
+        }
+    }
+}
+
+// give back a chain of magazines taken from depot
+void mp_depot_push_back(mp_magazine_t * volatile *depot, mp_magazine_t *rest)
+{
+    mp_magazine_t *last;
+    mp_magazine_t *head;
+    last = NULL;
+    for (;;) {
+        head = *depot;
+        if (head != NULL && last == NULL)
+        {
+            for (last = rest; last->next != NULL; last = last->next);
+        }
+        if (last != NULL)
+        {
+            last->next = head;
+        }
+        if (head == InterlockedCompareExchangePointer(depot,
+            rest,
+            head))
+        {
+            break;
+        }
+    }
+}
+
+// take the whole depot with one exchange, so it's free of ABA, then give
+// back all but the first magazine.
+mp_magazine_t *mp_depot_pop(mp_magazine_t * volatile *depot)
+{
+    mp_magazine_t *first;
+    first = InterlockedExchangePointer(depot, NULL);
+    if (first == NULL || first->next == NULL)
+    {
+        return first;
+    }
+    mp_depot_push_back(depot, first->next);
+    first->next = NULL;
+    return first;
+}
+
+void mp_depot_clear(mp_bucket_t *bucket, mp_magazine_t * volatile *depot)
+{
+    int i;
+    mp_magazine_t *mag;
+    mp_magazine_t *next;
+    mag = InterlockedExchangePointer(depot, NULL);
+    while (mag != NULL)
+    {
+        next = mag->next;
+        for (i = 0; i < mag->rounds; i++)
+        {
+            mp_bucket_release_entry(bucket, mag->round[i]);
+        }
+        memory_free(mag);
+        mag = next;
+    }
+}
+
+#ifdef USE_REMOTE_FREE
+// takes the record of an exited thread or a new one, without a record the
+// blocks of the thread have no owner
+void mp_owner_open(mp_thread_cache_t *cache)
+{
+    int i;
+    int id;
+    mp_owner_t *owner;
+    owner = NULL;
+    for (id = 1; id <= g_owner_count; id++)
+    {
+        if (g_owners[id] != NULL
+            && g_owners[id]->used == 0
+            && 0 == InterlockedCompareExchange(&g_owners[id]->used, 1, 0))
+        {
+            owner = g_owners[id];
+            break;
+        }
+    }
+    if (owner == NULL)
+    {
+        owner = memory_alloc(sizeof(mp_owner_t), 'omfl');
+        if (owner == NULL)
+        {
+            return;
+        }
+        owner->used = 1;
+        // a thread that finds all ids taken leaves the count alone
+        do {
+            id = g_owner_count;
+            if (id >= MP_MAX_OWNERS)
+            {
+                memory_free(owner);
+                return;
+            }
+        } while (id != InterlockedCompareExchange(&g_owner_count, id + 1, id));
+        id++;
+    }
+    // reopens the queues, blocks only get the id once the thread allocates
+    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    {
+        owner->remote[i] = NULL;
+    }
+    g_owners[id] = owner;
+    cache->owner = owner;
+    cache->owner_id = id;
+}
+
+// blocks whose owner has gone go to the usable list of their bucket
+static void mp_owner_chain_free(mp_entry_t *first)
+{
+    mp_entry_t *next;
+    while (first != NULL)
+    {
+        next = first->next;
+        mp_slist_push(&MP_ENTRY_SLAB(first)->bucket->usable, first);
+        first = next;
+    }
+}
+
+void mp_owner_batch_flush(mp_cache_bucket_t *cb, int idx)
+{
+    mp_owner_t *owner;
+    mp_entry_t *head;
+    if (cb->batch_first == NULL)
+    {
+        return;
+    }
+    owner = g_owners[cb->batch_owner];
+    for (;;)
+    {
+        head = owner->remote[idx];
+        if (head == MP_OWNER_CLOSED)
+        {
+            mp_owner_chain_free(cb->batch_first);
+            break;
+        }
+        cb->batch_last->next = head;
+        if (head == InterlockedCompareExchangePointer(&owner->remote[idx], cb->batch_first, head))
+        {
+            break;
+        }
+    }
+    cb->batch_first = NULL;
+    cb->batch_last = NULL;
+    cb->batch_count = 0;
+}
+
+// a batch holds the blocks of one owner, a block of another one sends it off
+int mp_owner_batch_push(mp_cache_bucket_t *cb, int idx, int owner, mp_entry_t *entry)
+{
+    if (cb->batch_first != NULL && cb->batch_owner != owner)
+    {
+        mp_owner_batch_flush(cb, idx);
+    }
+    entry->next = cb->batch_first;
+    cb->batch_first = entry;
+    if (cb->batch_last == NULL)
+    {
+        cb->batch_last = entry;
+    }
+    cb->batch_owner = owner;
+    if (++cb->batch_count >= MP_OWNER_BATCH_SIZE)
+    {
+        mp_owner_batch_flush(cb, idx);
+    }
+    return 1;
+}
+
+// blocks other threads gave back, the queue is taken whole once local is empty
+mp_entry_t *mp_owner_pop(mp_thread_cache_t *cache, mp_bucket_t *bucket, mp_cache_bucket_t *cb)
+{
+    mp_entry_t *entry;
+    for (;;)
+    {
+        if (cb->local == NULL)
+        {
+            if (cache->owner == NULL || cache->owner->remote[bucket->index] == NULL)
+            {
+                return NULL;
+            }
+            cb->local = InterlockedExchangePointer(&cache->owner->remote[bucket->index], NULL);
+        }
+        entry = cb->local;
+        cb->local = entry->next;
+        if (MP_ENTRY_SLAB(entry)->bucket == bucket)
+        {
+            return entry;
+        }
+        // pushed for the thread that had the record before, of another pool
+        mp_slist_push(&MP_ENTRY_SLAB(entry)->bucket->usable, entry);
+    }
+}
+
+// sends off the batches for other owners and closes the queues of the cache
+void mp_owner_close(mp_thread_cache_t *cache)
+{
+    int i;
+    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    {
+        mp_owner_batch_flush(&cache->buckets[i], i);
+        mp_owner_chain_free(cache->buckets[i].local);
+        cache->buckets[i].local = NULL;
+        if (cache->owner != NULL)
+        {
+            mp_owner_chain_free(InterlockedExchangePointer(&cache->owner->remote[i], MP_OWNER_CLOSED));
+        }
+    }
+    if (cache->owner != NULL)
+    {
+        InterlockedExchange(&cache->owner->used, 0);
+    }
+}
+
+void mp_owner_clear()
+{
+    int id;
+    for (id = 1; id <= MP_MAX_OWNERS; id++)
+    {
+        if (g_owners[id] != NULL)
+        {
+            memory_free(g_owners[id]);
+            g_owners[id] = NULL;
+        }
+    }
+    g_owner_count = 0;
+}
+#endif
+
+// the cache serves the pool of the node the thread first allocated on
+mp_thread_cache_t *mp_thread_cache_get()
+{
+    mp_thread_cache_t *cache;
+    cache = t_thread_cache;
+    if (cache == NULL)
+    {
+        cache = memory_alloc(sizeof(mp_thread_cache_t), 'cmfl');
+        if (cache != NULL)
+        {
+            memset(cache, 0, sizeof(mp_thread_cache_t));
+            cache->pool = mp_local_pool();
+#ifdef USE_REMOTE_FREE
+            mp_owner_open(cache);
+#endif
+            t_thread_cache = cache;
+            set_tls_value(g_thread_cache_key, cache);
+        }
+    }
+    return cache;
+}
+
+#ifdef USE_NUMA_POOLS
+void mp_remote_batch_flush(mp_bucket_t *bucket, mp_remote_batch_t *batch)
+{
+    if (batch->first != NULL)
+    {
+        mp_slist_push_chain(&bucket->usable, batch->first, batch->last);
+        batch->first = NULL;
+        batch->last = NULL;
+        batch->count = 0;
+    }
+}
+
+int mp_remote_batch_push(mp_thread_cache_t *cache, mp_bucket_t *bucket, mp_entry_t *entry)
+{
+    mp_remote_batch_t *batch;
+    if (cache->remote == NULL)
+    {
+        cache->remote = memory_alloc(sizeof(mp_remote_batch_t) * MP_POOL_NODES_NUMBER * MEMORY_POOL_BUCKETS_NUMBER,
+            'rmfl');
+        if (cache->remote == NULL)
+        {
+            return 0;
+        }
+        memset(cache->remote, 0, sizeof(mp_remote_batch_t) * MP_POOL_NODES_NUMBER * MEMORY_POOL_BUCKETS_NUMBER);
+    }
+    batch = &cache->remote[bucket->pool->node * MEMORY_POOL_BUCKETS_NUMBER + bucket->index];
+    entry->next = batch->first;
+    batch->first = entry;
+    if (batch->last == NULL)
+    {
+        batch->last = entry;
+    }
+    if (++batch->count >= MP_REMOTE_BATCH_SIZE)
+    {
+        mp_remote_batch_flush(bucket, batch);
+    }
+    return 1;
+}
+#endif
+
+void TLS_CALLBACK mp_thread_cache_destroy(void *param)
+{
+    int i;
+    mp_thread_cache_t *cache = (mp_thread_cache_t *)param;
+    mp_magazine_t *mag[2];
+    int j;
+#ifdef USE_REMOTE_FREE
+    mp_owner_close(cache);
+#endif
+#ifdef USE_NUMA_POOLS
+    if (cache->remote != NULL)
+    {
+        for (i = 0; i < MP_POOL_NODES_NUMBER * MEMORY_POOL_BUCKETS_NUMBER; i++)
+        {
+            mp_remote_batch_flush(&g_memory_pools[i / MEMORY_POOL_BUCKETS_NUMBER].buckets[i % MEMORY_POOL_BUCKETS_NUMBER],
+                &cache->remote[i]);
+        }
+        memory_free(cache->remote);
+    }
+#endif
+    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    {
+        mag[0] = cache->buckets[i].loaded;
+        mag[1] = cache->buckets[i].previous;
+        for (j = 0; j < 2; j++)
+        {
+            if (mag[j] == NULL)
+            {
+                continue;
+            }
+            if (mag[j]->rounds > 0)
+            {
+                mp_depot_push(&cache->pool->buckets[i].full_magazines, mag[j]);
+            }
+            else
+            {
+                mp_depot_push(&cache->pool->buckets[i].empty_magazines, mag[j]);
+            }
+        }
+    }
+    if (t_thread_cache == cache)
+    {
+        t_thread_cache = NULL;
+    }
+    memory_free(cache);
+}
+
+void mp_thread_cache_flush()
+{
+    mp_thread_cache_t *cache;
+    cache = t_thread_cache;
+    if (cache != NULL)
+    {
+        set_tls_value(g_thread_cache_key, NULL);
+        mp_thread_cache_destroy(cache);
+    }
+}
+
+// no atomics unless a whole magazine is exchanged with the depot or the
+// remote queue is taken
+mp_entry_t *mp_thread_cache_pop(mp_thread_cache_t *cache, mp_bucket_t *bucket)
+{
+    mp_magazine_t *mag;
+    mp_cache_bucket_t *cb;
+#ifdef USE_REMOTE_FREE
+    mp_entry_t *entry;
+#endif
+    cb = &cache->buckets[bucket->index];
+    if (cb->loaded != NULL && cb->loaded->rounds > 0)
+    {
+        return cb->loaded->round[--cb->loaded->rounds];
+    }
+    if (cb->previous != NULL && cb->previous->rounds > 0)
+    {
+        mag = cb->loaded;
+        cb->loaded = cb->previous;
+        cb->previous = mag;
+        return cb->loaded->round[--cb->loaded->rounds];
+    }
+#ifdef USE_REMOTE_FREE
+    entry = mp_owner_pop(cache, bucket, cb);
+    if (entry != NULL)
+    {
+        return entry;
+    }
+#endif
+    mag = mp_depot_pop(&bucket->full_magazines);
+    if (mag == NULL)
+    {
+        return NULL;
+    }
+    if (cb->previous != NULL)
+    {
+        mp_depot_push(&bucket->empty_magazines, cb->previous);
+    }
+    cb->previous = cb->loaded;
+    cb->loaded = mag;
+    return mag->round[--mag->rounds];
+}
+
+int mp_thread_cache_push(mp_bucket_t *bucket, mp_cache_bucket_t *cb, mp_entry_t *entry)
+{
+    mp_magazine_t *mag;
+    if (cb->loaded == NULL || cb->loaded->rounds >= MP_MAGAZINE_SIZE)
+    {
+        if (cb->previous != NULL && cb->previous->rounds == 0)
+        {
+            mag = cb->loaded;
+            cb->loaded = cb->previous;
+            cb->previous = mag;
+        }
+        else
+        {
+            mag = mp_depot_pop(&bucket->empty_magazines);
+            if (mag == NULL)
+            {
+                mag = memory_alloc(sizeof(mp_magazine_t), 'gmfl');
+                if (mag == NULL)
+                {
+                    return 0;
+                }
+            }
+            mag->rounds = 0;
+            if (cb->previous != NULL)
+            {
+                mp_depot_push(&bucket->full_magazines, cb->previous);
+            }
+            cb->previous = cb->loaded;
+            cb->loaded = mag;
+        }
+    }
+    cb->loaded->round[cb->loaded->rounds++] = entry;
+    return 1;
+}
+#endif
+
+void mp_bucket_init(mp_bucket_t *bucket, 
+    memory_pool_t *pool,
+    int index,
+    int block_size, 
+    unsigned int threshold)
+{
+    size_t slab_size;
+    size_t stride;
+    unsigned int batch;
+    mp_slist_init(&bucket->usable);
+#ifdef USE_FREE_THREAD
+    mp_slist_init(&bucket->unusable);
+    bucket->pending = NULL;
+    bucket->pending_slot = -1;
+#endif
+#ifdef USE_THREAD_CACHE
+    bucket->full_magazines = NULL;
+    bucket->empty_magazines = NULL;
+#endif
+    bucket->slabs = 0;
+#ifdef USE_DECAY
+    bucket->refills = 0;
+    bucket->decay_refills = 0;
+#endif
+#ifdef USE_ADAPTIVE_THRESHOLD
+    bucket->misses = 0;
+    bucket->releases = 0;
+    bucket->high_water = 0;
+#endif
+    bucket->block_size = block_size;
+    bucket->threshold = threshold;
+	bucket->next = NULL;
+    bucket->pool = pool;
+    bucket->index = index;
+
+#ifdef MP_HEADERLESS_SMALL
+    if (block_size <= MP_HEADERLESS_MAX_SIZE)
+    {
+        // a free block only keeps its next pointer
+        bucket->header_size = 0;
+        stride = MP_ROUND_UP((size_t)((size_t)block_size < sizeof(void *) ? sizeof(void *) : (size_t)block_size),
+            sizeof(void *));
+    }
+    else
+#endif
+    {
+        bucket->header_size = MP_ENTRY_HEADER_SIZE;
+        stride = MP_ENTRY_HEADER_SIZE + MP_ROUND_UP((size_t)block_size, MP_ALIGN_SIZE);
+    }
+    bucket->stride = (unsigned int)stride;
+    slab_size = MP_SLAB_HEADER_SIZE + MP_SLAB_MIN_BLOCKS * stride;
+    if (slab_size > MP_SLAB_MAX_SIZE)
+    {
+        slab_size = MP_SLAB_MAX_SIZE;
+    }
+    slab_size = MP_ROUND_UP(slab_size, PAGE_ALLOC_GRANULARITY);
+    bucket->slab_blocks = (unsigned int)((slab_size - MP_SLAB_HEADER_SIZE) / stride);
+    if (bucket->slab_blocks == 0)
+    {
+        bucket->slab_blocks = 1;
+    }
+    // keep the lag of the entries total within an eighth of threshold
+    batch = threshold / block_size / (MP_COUNTER_SHARDS * 8);
+    mp_counter_init(&bucket->entries, (batch < MP_COUNTER_MAX_BATCH) ? (int)batch : MP_COUNTER_MAX_BATCH);
+#ifdef MP_LATENCY_HISTOGRAM
+    memset(bucket->latency, 0, sizeof(bucket->latency));
+#endif
+}
+
+void mp_bucket_clear(mp_bucket_t *bucket)
+{
+    mp_slist_clear(bucket, &bucket->usable);
+#ifdef USE_FREE_THREAD
+    mp_slist_clear(bucket, &bucket->unusable);
+    mp_entry_chain_release(bucket, bucket->pending);
+    bucket->pending = NULL;
+#endif
+#ifdef USE_THREAD_CACHE
+    mp_depot_clear(bucket, &bucket->full_magazines);
+    mp_depot_clear(bucket, &bucket->empty_magazines);
+#endif
+}
+
+#ifdef USE_ADAPTIVE_THRESHOLD
+// new threshold of every size class bucket of pool, see USE_ADAPTIVE_THRESHOLD.
+// Thresholds move half way to the target each round, so a bucket that
+// overflowed once doesn't swing the split back and forth.
+static void mp_pool_adapt(memory_pool_t *pool)
+{
+    int i;
+    int high_water;
+    int releases;
+    int misses;
+    mp_bucket_t *bucket;
+    unsigned long long need[MEMORY_POOL_BUCKETS_NUMBER];
+    unsigned long long pressure[MEMORY_POOL_BUCKETS_NUMBER];
+    unsigned long long total_need = 0;
+    unsigned long long total_pressure = 0;
+    unsigned long long spare;
+    unsigned long long target;
+    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    {
+        bucket = &pool->buckets[i];
+        high_water = InterlockedExchange(&bucket->high_water, mp_counter_read(&bucket->entries));
+        releases = InterlockedExchange(&bucket->releases, 0);
+        misses = InterlockedExchange(&bucket->misses, 0);
+        need[i] = (unsigned long long)bucket->block_size 
+            * ((high_water > 0 ? high_water : 0) + bucket->slab_blocks);
+        // a bucket capped by its threshold misses again for what it released
+        pressure[i] = (releases == 0) ? 0 
+            : (unsigned long long)bucket->block_size * ((unsigned int)releases + misses);
+        total_need += need[i];
+        total_pressure += pressure[i];
+    }
+    spare = (total_need < pool->budget) ? pool->budget - total_need : 0;
+    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    {
+        bucket = &pool->buckets[i];
+        if (spare == 0)
+        {
+            target = (unsigned long long)((double)pool->budget * need[i] / total_need);
+        }
+        else if (total_pressure != 0)
+        {
+            target = need[i] + (unsigned long long)((double)spare * pressure[i] / total_pressure);
+        }
+        else
+        {
+            target = need[i] + (unsigned long long)((double)spare * need[i] / total_need);
+        }
+        target = (target + bucket->threshold) / 2;
+        if (target < bucket->block_size)
+        {
+            target = bucket->block_size;
+        }
+        if (target > 0x7fffffff)
+        {
+            target = 0x7fffffff;
+        }
+        bucket->threshold = (unsigned int)target;
+    }
+}
+#endif
+
+static __inline void mp_bucket_count_refill(mp_bucket_t *bucket)
+{
+#ifdef USE_ADAPTIVE_THRESHOLD
+    int entries;
+    int high_water;
+    memory_pool_t *pool;
+#endif
+#ifdef USE_DECAY
+    InterlockedIncrement(&bucket->refills);
+#endif
+    if (bucket->index < 0)
+    {
+        // registered buckets keep the threshold they were given
+        return;
+    }
+#ifdef USE_ADAPTIVE_THRESHOLD
+    pool = bucket->pool;
+    InterlockedIncrement(&bucket->misses);
+    entries = mp_counter_read(&bucket->entries);
+    while (entries > (high_water = bucket->high_water))
+    {
+        if (high_water == InterlockedCompareExchange(&bucket->high_water, entries, high_water))
+        {
+            break;
+        }
+    }
+    if (InterlockedIncrement(&pool->refills) % MP_ADAPT_REFILLS == 0
+        && InterlockedCompareExchange(&pool->adapting, 1, 0) == 0)
+    {
+        mp_pool_adapt(pool);
+        InterlockedExchange(&pool->adapting, 0);
+    }
+#else
+    InterlockedIncrement(&bucket->pool->refills);
+#endif
+}
+
+// carve a new slab, keep the first entry and publish the others with one push
+mp_entry_t *mp_bucket_refill(mp_bucket_t *bucket, unsigned long tag)
+{
+    unsigned int i;
+    unsigned int n;
+    int room;
+    size_t stride;
+    size_t slab_size;
+    mp_slab_t *slab;
+    mp_entry_t *entry;
+    unsigned char *base;
+
+    stride = bucket->stride;
+    n = bucket->slab_blocks;
+    // don't carve more than the threshold lets the bucket keep
+    room = (int)(bucket->threshold / bucket->block_size) - mp_counter_read(&bucket->entries);
+    if (room < (int)n)
+    {
+        n = (room > 1) ? (unsigned int)room : 1;
+    }
+    slab_size = MP_ROUND_UP(MP_SLAB_HEADER_SIZE + n * stride, PAGE_ALLOC_GRANULARITY);
+    // entries counts live blocks too, past the threshold each refill would
+    // map a granule for one block, so at least fill the granules mapped
+    if ((slab_size - MP_SLAB_HEADER_SIZE) / stride > n)
+    {
+        n = (unsigned int)((slab_size - MP_SLAB_HEADER_SIZE) / stride);
+    }
+#ifdef MP_SLIST_TAGGED
+    slab = mp_pool_reuse_slab(bucket->pool, slab_size);
+    if (slab == NULL)
+#endif
+    {
+        slab = page_alloc_node(slab_size, 
+            (g_memory_pool_count > 1) ? bucket->pool->node : -1, 
+            tag);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        slab->size = slab_size;
+        slab->tag = tag;
+    }
+    slab->next = NULL;
+    slab->bucket = bucket;
+    slab->pool = bucket->pool;
+    slab->blocks = n;
+    slab->retired = 0;
+#ifdef MP_HEADERLESS_SMALL
+    if (!mp_pagemap_set(slab, slab))
+    {
+        mp_slab_unmap(slab);
+        return NULL;
+    }
+#endif
+
+    base = (unsigned char *)slab + MP_SLAB_HEADER_SIZE;
+    for (i = 0; i < n; i++)
+    {
+        entry = (mp_entry_t *)(base + i * stride);
+        entry->next = (i + 1 < n) ? (mp_entry_t *)(base + (i + 1) * stride) : NULL;
+        if (bucket->header_size != 0)
+        {
+            entry->slab = slab;
+            entry->size = bucket->block_size;
+            entry->ref_cnt = MP_ENTRY_INITIAL_REFER_COUNT;
+            entry->owned = 1;
+        }
+    }
+    mp_counter_add(&bucket->entries, (int)n);
+    InterlockedIncrement(&bucket->slabs);
+
+    entry = (mp_entry_t *)base;
+    if (n > 1)
+    {
+        mp_slist_push_chain(&bucket->usable, 
+            entry->next, 
+            (mp_entry_t *)(base + (n - 1) * stride));
+    }
+    mp_bucket_count_refill(bucket);
+    return entry;
+}
+
+// the pool of the thread cache, or of the node the caller runs on
+static __inline memory_pool_t *mp_caller_pool()
+{
+#ifdef USE_THREAD_CACHE
+    if (t_thread_cache != NULL)
+    {
+        return t_thread_cache->pool;
+    }
+#endif
+    return mp_local_pool();
+}
+
+// bucket of the calling thread's pool for size, NULL if it's too large
+static __inline mp_bucket_t *mp_class_bucket(int idx)
+{
+    return &mp_caller_pool()->buckets[idx];
+}
+
+static __inline mp_bucket_t *mp_size_bucket(size_t size)
+{
+    int idx;
+    idx = mp_lookup_bucket(size > 0xffffffff ? 0xffffffff : (unsigned int)size);
+    if (idx >= MEMORY_POOL_BUCKETS_NUMBER)
+    {
+        return NULL;
+    }
+    return mp_class_bucket(idx);
+}
+
+#ifdef MP_LATENCY_HISTOGRAM
+static __inline unsigned long long mp_rdtsc()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    unsigned long long v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static __inline int mp_latency_slot(unsigned long long v)
+{
+    int lg;
+    if (v >= (1ULL << MP_LATENCY_MAX_LG))
+    {
+        v = (1ULL << MP_LATENCY_MAX_LG) - 1;
+    }
+    if (v < (1 << MP_LATENCY_SUB_BITS))
+    {
+        return (int)v;
+    }
+    lg = (v >> 32) ? 32 + mp_log2((unsigned int)(v >> 32)) : mp_log2((unsigned int)v);
+    return ((lg - MP_LATENCY_SUB_BITS + 1) << MP_LATENCY_SUB_BITS)
+        + (int)((v >> (lg - MP_LATENCY_SUB_BITS)) & ((1 << MP_LATENCY_SUB_BITS) - 1));
+}
+
+// largest value counted in slot
+static unsigned long long mp_latency_slot_value(int slot)
+{
+    int lg;
+    if (slot < (1 << MP_LATENCY_SUB_BITS))
+    {
+        return slot;
+    }
+    lg = (slot >> MP_LATENCY_SUB_BITS) + MP_LATENCY_SUB_BITS - 1;
+    return ((unsigned long long)((slot & ((1 << MP_LATENCY_SUB_BITS) - 1)) | (1 << MP_LATENCY_SUB_BITS))
+        << (lg - MP_LATENCY_SUB_BITS)) + (1ULL << (lg - MP_LATENCY_SUB_BITS)) - 1;
+}
+
+unsigned long long mp_histogram_percentile(const mp_histogram_t *h, double percent)
+{
+    int i;
+    unsigned long long total = 0;
+    unsigned long long seen = 0;
+    unsigned long long rank;
+    for (i = 0; i < MP_LATENCY_SLOTS; i++)
+    {
+        total += (unsigned int)h->count[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    rank = (unsigned long long)(total * percent / 100);
+    if (rank >= total)
+    {
+        rank = total - 1;
+    }
+    for (i = 0; i < MP_LATENCY_SLOTS; i++)
+    {
+        seen += (unsigned int)h->count[i];
+        if (seen > rank)
+        {
+            break;
+        }
+    }
+    return mp_latency_slot_value(i);
+}
+
+static void mp_histogram_add(mp_histogram_t *to, const mp_histogram_t *from)
+{
+    int i;
+    for (i = 0; i < MP_LATENCY_SLOTS; i++)
+    {
+        if (from->count[i] != 0)
+        {
+            InterlockedAdd(&to->count[i], from->count[i]);
+        }
+    }
+}
+
+void TLS_CALLBACK mp_thread_latency_exit(void *param)
+{
+    ((mp_thread_latency_t *)param)->exited = 1;
+}
+
+mp_thread_latency_t *mp_thread_latency_get()
+{
+    int op;
+    mp_thread_latency_t *t;
+    for (t = g_latency_threads; t != NULL; t = t->next)
+    {
+        if (t->exited && InterlockedCompareExchange(&t->exited, 0, 1) == 1)
+        {
+            for (op = 0; op < MP_LATENCY_OPS; op++)
+            {
+                mp_histogram_add(&g_latency_exited[op], &t->ops[op]);
+            }
+            memset(t->ops, 0, sizeof(t->ops));
+            break;
+        }
+    }
+    if (t == NULL)
+    {
+        t = memory_alloc(sizeof(mp_thread_latency_t), 'lmfl');
+        if (t == NULL)
+        {
+            return NULL;
+        }
+        memset(t, 0, sizeof(mp_thread_latency_t));
+        for (;;) {
+            mp_thread_latency_t *first = g_latency_threads;
+            t->next = first;
+            if (first == InterlockedCompareExchangePointer(&g_latency_threads, t, first))
+            {
+                break;
+            }
+        }
+    }
+    t->id = InterlockedIncrement(&g_latency_thread_ids);
+    for (op = 0; op < MP_LATENCY_OPS; op++)
+    {
+        t->countdown[op] = MP_LATENCY_SAMPLE_RATE;
+    }
+    t_latency = t;
+    set_tls_value(g_latency_key, t);
+    return t;
+}
+
+// the calling thread's record when this operation is to be timed, ops
+// count down separately so a fixed malloc/free pattern can't hide one.
+static __inline mp_thread_latency_t *mp_latency_sample(int op)
+{
+    mp_thread_latency_t *t;
+    t = t_latency;
+    if (t != NULL && --t->countdown[op] != 0)
+    {
+        return NULL;
+    }
+    if (t == NULL && (t = mp_thread_latency_get()) == NULL)
+    {
+        return NULL;
+    }
+    t->countdown[op] = MP_LATENCY_SAMPLE_RATE;
+    return t;
+}
+
+static __inline void mp_latency_record(mp_thread_latency_t *t, mp_bucket_t *bucket, int op, unsigned long long cycles)
+{
+    int slot;
+    slot = mp_latency_slot(cycles);
+    t->ops[op].count[slot]++;
+    if (bucket != NULL)
+    {
+        // large blocks have no bucket
+        InterlockedIncrement(&bucket->latency[op].count[slot]);
+    }
+}
+
+void mp_bucket_latency(mp_bucket_t *bucket, int op, mp_histogram_t *h)
+{
+    memcpy(h, &bucket->latency[op], sizeof(mp_histogram_t));
+}
+
+void mp_thread_latency(int op, mp_histogram_t *h)
+{
+    if (t_latency != NULL)
+    {
+        memcpy(h, &t_latency->ops[op], sizeof(mp_histogram_t));
+    }
+    else
+    {
+        memset(h, 0, sizeof(mp_histogram_t));
+    }
+}
+
+void mp_all_threads_latency(int op, mp_histogram_t *h)
+{
+    mp_thread_latency_t *t;
+    memcpy(h, &g_latency_exited[op], sizeof(mp_histogram_t));
+    for (t = g_latency_threads; t != NULL; t = t->next)
+    {
+        mp_histogram_add(h, &t->ops[op]);
+    }
+}
+#endif
+
+static __inline void *mp_bucket_malloc_block(mp_bucket_t *bucket, size_t size, unsigned long tag)
+{
+    mp_entry_t *entry;
+#ifdef USE_REMOTE_FREE
+    int owner = 0;
+#endif
+#ifdef USE_THREAD_CACHE
+    mp_thread_cache_t *cache;
+#endif
+	if (bucket == NULL)
+	{
+		bucket = mp_size_bucket(size);
+		if (bucket == NULL)
+		{
+			return mp_large_malloc(mp_caller_pool(), size, tag, NULL);
+		}
+	}
+	if (size > (size_t)bucket->block_size)
+	{
+		return NULL;
+	}
+#ifdef USE_THREAD_CACHE
+    // only the size classes of the caller's pool are cached, large blocks and
+    // registered buckets don't make the thread set up a cache
+    if (bucket->index >= 0 && bucket->pool == mp_caller_pool()
+        && (cache = mp_thread_cache_get()) != NULL)
+    {
+#ifdef USE_REMOTE_FREE
+        owner = cache->owner_id;
+#endif
+        entry = mp_thread_cache_pop(cache, bucket);
+        if (entry != NULL)
+        {
+            MP_ENTRY_SET_OWNER(bucket, entry, owner);
+            return (void *)((unsigned char *)entry + bucket->header_size);
+        }
+    }
+#endif
+    entry = mp_slist_pop(&bucket->usable);
+    if (entry == NULL)
+    {
+        entry = mp_bucket_refill(bucket, tag);
+        if (entry == NULL)
+        {
+            return NULL;
+        }
+    }
+    MP_ENTRY_SET_OWNER(bucket, entry, owner);
+
+	return (void *)((unsigned char *)entry + bucket->header_size);
+}
+
+// fills p with up to n blocks of size, returns how many it got
+int mp_bucket_malloc_bulk(mp_bucket_t *bucket, size_t size, int n, void **p, unsigned long tag)
+{
+    int i;
+    int got;
+    mp_entry_t *entry;
+#ifdef USE_REMOTE_FREE
+    int owner = 0;
+#endif
+#ifdef USE_THREAD_CACHE
+    mp_thread_cache_t *cache;
+#endif
+	if (bucket == NULL)
+	{
+		bucket = mp_size_bucket(size);
+		if (bucket == NULL)
+		{
+			// large blocks are mapped one by one anyway
+			for (got = 0; got < n; got++)
+			{
+				p[got] = mp_large_malloc(mp_caller_pool(), size, tag, NULL);
+				if (p[got] == NULL)
+				{
+					break;
+				}
+			}
+			return got;
+		}
+	}
+	if (size > (size_t)bucket->block_size)
+	{
+		return 0;
+	}
+    got = 0;
+#ifdef USE_THREAD_CACHE
+    if (bucket->index >= 0 && bucket->pool == mp_caller_pool()
+        && (cache = mp_thread_cache_get()) != NULL)
+    {
+#ifdef USE_REMOTE_FREE
+        owner = cache->owner_id;
+#endif
+        while (got < n 
+            && (entry = mp_thread_cache_pop(cache, bucket)) != NULL)
+        {
+            p[got++] = entry;
+        }
+    }
+#endif
+    while (got < n)
+    {
+        i = mp_slist_pop_bulk(&bucket->usable, n - got, (mp_entry_t **)&p[got]);
+        got += i;
+        if (got < n && i == 0)
+        {
+            // the rest of the new slab is on usable for the next round
+            entry = mp_bucket_refill(bucket, tag);
+            if (entry == NULL)
+            {
+                break;
+            }
+            p[got++] = entry;
+        }
+    }
+    for (i = 0; i < got; i++)
+    {
+        MP_ENTRY_SET_OWNER(bucket, (mp_entry_t *)p[i], owner);
+        p[i] = (unsigned char *)p[i] + bucket->header_size;
+    }
+    return got;
+}
+
+#define mp_bucket_should_release(bucket, slab) \
+    ((bucket)->block_size * (mp_counter_read(&(bucket)->entries) + 1) > (bucket)->threshold \
+        || (slab)->retired != 0)
+
+// entry is out of every list: release it now or, while a pop may still
+// read it, once the usable list is quiescent
+void mp_bucket_retire_entry(mp_bucket_t *bucket, mp_entry_t *entry)
+{
+#ifndef MP_SLIST_TAGGED
+    if (entry->ref_cnt != MP_ENTRY_INITIAL_REFER_COUNT)
+    {
+#ifdef USE_FREE_THREAD
+        if (!mp_slist_quiescent(&bucket->usable))
+        {
+            mp_slist_push(&bucket->unusable, entry);
+            if (0 == InterlockedExchange(&bucket->pool->require_free, 1))
+            {
+                set_event(&bucket->pool->reclaim_event);
+            }
+            return;
+        }
+#else
+        while (!mp_slist_quiescent(&bucket->usable)); // safe for free
+#endif
+    }
+#endif
+    mp_bucket_release_entry(bucket, entry);
+}
+
+// an entry still referred by a pop is pushed by whoever drops the last reference
+static void mp_bucket_push_entry(mp_bucket_t *bucket, mp_entry_t *entry)
+{
+#ifdef MP_SLIST_TAGGED
+    mp_slist_push(&bucket->usable, entry);
+#else
+    if (entry->ref_cnt == MP_ENTRY_INITIAL_REFER_COUNT)
+    {
+        mp_slist_push(&bucket->usable, entry);
+    }
+    else
+    {
+        int slot;
+        InterlockedExchange(&entry->owned, 0);
+        slot = mp_slist_enter(&bucket->usable);
+        if (MP_ENTRY_INITIAL_REFER_COUNT == InterlockedDecrement(&entry->ref_cnt))
+        {
+            if (InterlockedCompareExchange(&entry->owned, 1, 0) == 0)
+            {
+                mp_slist_push(&bucket->usable, entry);
+            }
+        }
+        mp_slist_leave(&bucket->usable, slot);
+    }
+#endif
+}
+
+void mp_bucket_free_entry(mp_bucket_t *bucket, mp_entry_t *entry)
+{
+#ifndef MP_SLIST_TAGGED
+    assert(entry->ref_cnt >= MP_ENTRY_INITIAL_REFER_COUNT);
+#endif
+    if (mp_bucket_should_release(bucket, MP_ENTRY_SLAB(entry)))
+    {
+#ifdef USE_ADAPTIVE_THRESHOLD
+        InterlockedIncrement(&bucket->releases);
+#endif
+        mp_bucket_retire_entry(bucket, entry);
+        return;
+    }
+    mp_bucket_push_entry(bucket, entry);
+}
+
+// an aligned block is cut from a larger one, the header in front of it is
+// a shadow with size 0 whose next is the entry of the real block
+#define MP_ENTRY_SHADOW(entry) ((entry)->size == 0)
+
+static __inline mp_entry_t *mp_block_entry(mp_bucket_t **bucket, mp_slab_t **slab, void *p)
+{
+#ifdef MP_HEADERLESS_SMALL
+    mp_entry_t *entry;
+    *slab = mp_pagemap_lookup(p);
+    *bucket = (*slab)->bucket;
+    if (MP_SLAB_LARGE(*slab))
+    {
+        entry = (mp_entry_t *)((unsigned char *)p - MP_ENTRY_HEADER_SIZE);
+    }
+    else if ((*bucket)->header_size == 0)
+    {
+        return (mp_entry_t *)p;
+    }
+    else
+    {
+        entry = (mp_entry_t *)((unsigned char *)p - (*bucket)->header_size);
+    }
+    return MP_ENTRY_SHADOW(entry) ? entry->next : entry;
+#else
+    mp_entry_t *entry;
+	entry = (mp_entry_t *)((unsigned char *)p - MP_ENTRY_HEADER_SIZE);
+    if (MP_ENTRY_SHADOW(entry))
+    {
+        entry = entry->next;
+    }
+    *slab = entry->slab;
+	if (*bucket == NULL)
+	{
+		*bucket = (*slab)->bucket;
+	}
+    return entry;
+#endif
+}
+
+#ifdef USE_THREAD_CACHE
+// entries still touched by a concurrent pop go through the list protocol
+int mp_thread_cache_free(mp_bucket_t *bucket, mp_slab_t *slab, mp_entry_t *entry)
+{
+    mp_thread_cache_t *cache;
+#ifdef USE_REMOTE_FREE
+    int owner;
+#endif
+    if (bucket->index >= 0
+        && MP_ENTRY_UNSHARED(entry)
+        && !mp_bucket_should_release(bucket, slab)
+        && (cache = mp_thread_cache_get()) != NULL)
+    {
+#ifdef USE_REMOTE_FREE
+        owner = MP_ENTRY_OWNER(bucket, entry);
+        if (owner != 0 && owner != cache->owner_id)
+        {
+            return mp_owner_batch_push(&cache->buckets[bucket->index], bucket->index, owner, entry);
+        }
+#endif
+        if (bucket->pool == cache->pool)
+        {
+            return mp_thread_cache_push(bucket, &cache->buckets[bucket->index], entry);
+        }
+#ifdef USE_NUMA_POOLS
+        // batches are kept per node, created pools take their blocks at once
+        if (MP_NODE_POOL(bucket->pool))
+        {
+            return mp_remote_batch_push(cache, bucket, entry);
+        }
+#endif
+    }
+    return 0;
+}
+#endif
+
+static __inline void mp_bucket_free_block(mp_bucket_t *bucket, void *p)
+{
+	mp_entry_t *entry;
+    mp_slab_t *slab;
+    entry = mp_block_entry(&bucket, &slab, p);
+    if (MP_SLAB_LARGE(slab))
+    {
+        mp_large_free(slab);
+        return;
+    }
+#ifdef USE_THREAD_CACHE
+    if (mp_thread_cache_free(bucket, slab, entry))
+    {
+        return;
+    }
+#endif
+	mp_bucket_free_entry(bucket, entry);
+}
+
+// entries that may go straight to the usable list are chained per bucket
+// and spliced with one CAS, the others take the mp_bucket_free path.
+void mp_bucket_free_bulk(mp_bucket_t *bucket, int n, void **p)
+{
+    int i;
+    mp_bucket_t *owner;
+    mp_bucket_t *chain_bucket;
+    mp_entry_t *first;
+    mp_entry_t *last;
+	mp_entry_t *entry;
+    mp_slab_t *slab;
+    chain_bucket = NULL;
+    first = NULL;
+    last = NULL;
+    for (i = 0; i < n; i++)
+    {
+        if (p[i] == NULL)
+        {
+            continue;
+        }
+        owner = bucket;
+        entry = mp_block_entry(&owner, &slab, p[i]);
+        if (MP_SLAB_LARGE(slab))
+        {
+            mp_large_free(slab);
+            continue;
+        }
+#ifdef USE_THREAD_CACHE
+        if (mp_thread_cache_free(owner, slab, entry))
+        {
+            continue;
+        }
+#endif
+        if (!MP_ENTRY_UNSHARED(entry) || mp_bucket_should_release(owner, slab))
+        {
+            mp_bucket_free_entry(owner, entry);
+            continue;
+        }
+        if (owner != chain_bucket && first != NULL)
+        {
+            mp_slist_push_chain(&chain_bucket->usable, first, last);
+            first = NULL;
+        }
+        chain_bucket = owner;
+        entry->next = first;
+        if (first == NULL)
+        {
+            last = entry;
+        }
+        first = entry;
+    }
+    if (first != NULL)
+    {
+        mp_slist_push_chain(&chain_bucket->usable, first, last);
+    }
+}
+
+void *mp_bucket_malloc(mp_bucket_t *bucket, size_t size, unsigned long tag)
+{
+#ifdef MP_LATENCY_HISTOGRAM
+    void *p;
+    mp_slab_t *slab;
+    mp_thread_latency_t *t;
+    unsigned long long cycles;
+    if ((t = mp_latency_sample(MP_LATENCY_MALLOC)) != NULL)
+    {
+        cycles = mp_rdtsc();
+        p = mp_bucket_malloc_block(bucket, size, tag);
+        cycles = mp_rdtsc() - cycles;
+        if (p != NULL)
+        {
+            mp_block_entry(&bucket, &slab, p);
+            mp_latency_record(t, bucket, MP_LATENCY_MALLOC, cycles);
+        }
+        return p;
+    }
+#endif
+    return mp_bucket_malloc_block(bucket, size, tag);
+}
+
+void *mp_class_malloc(int idx, unsigned long tag)
+{
+    mp_bucket_t *bucket;
+    bucket = mp_class_bucket(idx);
+    return mp_bucket_malloc(bucket, bucket->block_size, tag);
+}
+
+// alignment every block of bucket has: slabs start on a granule and carve
+// their blocks at MP_ALIGN_SIZE aligned offsets, headerless strides may be
+// less aligned. A large block (bucket NULL) gets MP_ALIGN_SIZE as well.
+static __inline size_t mp_bucket_align(mp_bucket_t *bucket)
+{
+    size_t stride;
+    if (bucket == NULL || bucket->header_size != 0)
+    {
+        return MP_ALIGN_SIZE;
+    }
+    stride = bucket->stride;
+    return ((stride & (0 - stride)) < MP_ALIGN_SIZE) ? (stride & (0 - stride)) : MP_ALIGN_SIZE;
+}
+
+// room to move an MP_ALIGN_SIZE aligned block up to align with a shadow
+// header in front, where the header is larger than MP_ALIGN_SIZE a move
+// shorter than the header goes on by another align
+#define MP_ALIGNED_EXTRA(align) (((align) <= MP_ALIGN_SIZE) ? 0 : \
+    (align) - MP_ALIGN_SIZE + ((MP_ENTRY_HEADER_SIZE > MP_ALIGN_SIZE) ? MP_ENTRY_HEADER_SIZE : 0))
+
+// a block of size at a multiple of align, a power of two. Blocks that are
+// aligned enough by their bucket are served as they are, otherwise a block
+// larger by MP_ALIGNED_EXTRA is cut at the first aligned address that
+// leaves room for a shadow header, which mp_bucket_free follows back.
+void *mp_bucket_malloc_aligned(mp_bucket_t *bucket, size_t align, size_t size, unsigned long tag)
+{
+    size_t n;
+    unsigned char *p;
+    unsigned char *q;
+    mp_entry_t *shadow;
+    if (align == 0 || (align & (align - 1)) != 0)
+    {
+        return NULL;
+    }
+    if (align <= mp_bucket_align((bucket != NULL) ? bucket : mp_size_bucket(size)))
+    {
+        return mp_bucket_malloc(bucket, size, tag);
+    }
+    if (size > (size_t)-1 - MP_ALIGNED_EXTRA(align))
+    {
+        return NULL;
+    }
+    n = size + MP_ALIGNED_EXTRA(align);
+#ifdef MP_HEADERLESS_SMALL
+    // the shadow needs a bucket with entry headers
+    if (bucket == NULL && n <= MP_HEADERLESS_MAX_SIZE)
+    {
+        n = MP_HEADERLESS_MAX_SIZE + 1;
+    }
+#endif
+    if (bucket != NULL && bucket->header_size == 0)
+    {
+        return NULL;
+    }
+    p = (unsigned char *)mp_bucket_malloc(bucket, n, tag);
+    if (p == NULL)
+    {
+        return NULL;
+    }
+    q = (unsigned char *)(((size_t)p + align - 1) & ~(align - 1));
+    if (q == p)
+    {
+        return p;
+    }
+    if ((size_t)(q - p) < MP_ENTRY_HEADER_SIZE)
+    {
+        q += align;
+    }
+    shadow = (mp_entry_t *)(q - MP_ENTRY_HEADER_SIZE);
+    shadow->next = (mp_entry_t *)(p - MP_ENTRY_HEADER_SIZE);
+    shadow->slab = shadow->next->slab;
+    shadow->size = 0;
+    return q;
+}
+
+void mp_bucket_free(mp_bucket_t *bucket, void *p)
+{
+#ifdef MP_LATENCY_HISTOGRAM
+    mp_bucket_t *owner;
+    mp_slab_t *slab;
+    mp_thread_latency_t *t;
+    unsigned long long cycles;
+    if ((t = mp_latency_sample(MP_LATENCY_FREE)) != NULL)
+    {
+        // the slab may be gone after the free
+        owner = bucket;
+        mp_block_entry(&owner, &slab, p);
+        cycles = mp_rdtsc();
+        mp_bucket_free_block(bucket, p);
+        mp_latency_record(t, owner, MP_LATENCY_FREE, mp_rdtsc() - cycles);
+        return;
+    }
+#endif
+    mp_bucket_free_block(bucket, p);
+}
+
+// usable bytes of p, measured from p for aligned blocks
+static size_t mp_block_usable(void *p, mp_slab_t **slab)
+{
+    mp_bucket_t *bucket;
+    unsigned char *block;
+    size_t size;
+    bucket = NULL;
+    block = (unsigned char *)mp_block_entry(&bucket, slab, p);
+    if (MP_SLAB_LARGE(*slab))
+    {
+        block += MP_ENTRY_HEADER_SIZE;
+        size = (*slab)->size - MP_LARGE_HEADER_SIZE;
+    }
+    else
+    {
+        block += bucket->header_size;
+        size = (size_t)bucket->block_size;
+    }
+    return size - (size_t)((unsigned char *)p - block);
+}
+
+size_t mp_usable_size(void *p)
+{
+    mp_slab_t *slab;
+    return mp_block_usable(p, &slab);
+}
+
+// p stays where it is as long as size fits its block. A large block moves
+// when it would use less than half of its mapping, so the rest can go back.
+void *mp_bucket_realloc(mp_bucket_t *bucket, void *p, size_t size, unsigned long tag)
+{
+    void *q;
+    size_t usable;
+    mp_slab_t *slab;
+    if (p == NULL)
+    {
+        return mp_bucket_malloc(bucket, size, tag);
+    }
+    if (size == 0)
+    {
+        mp_bucket_free(NULL, p);
+        return NULL;
+    }
+    usable = mp_block_usable(p, &slab);
+    if (size <= usable && (!MP_SLAB_LARGE(slab) || size > usable / 2))
+    {
+        return p;
+    }
+    q = mp_bucket_malloc(bucket, size, tag);
+    if (q != NULL)
+    {
+        memcpy(q, p, (size < usable) ? size : usable);
+        mp_bucket_free(NULL, p);
+    }
+    return q;
+}
+
+// fresh large mappings are zero already, everything else is cleared
+void *mp_bucket_calloc(mp_bucket_t *bucket, size_t n, size_t size, unsigned long tag)
+{
+    void *p;
+    int zeroed;
+    if (size != 0 && n > (size_t)-1 / size)
+    {
+        return NULL;
+    }
+    size *= n;
+    zeroed = 0;
+    if (bucket == NULL && size > MP_SIZE_CLASS_MAX_SIZE)
+    {
+        p = mp_large_malloc(mp_caller_pool(), size, tag, &zeroed);
+    }
+    else
+    {
+        p = mp_bucket_malloc(bucket, size, tag);
+    }
+    if (p != NULL && !zeroed)
+    {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+#ifdef USE_FREE_THREAD
+// one step of the deferred reclamation of a bucket, returns non-zero while
+// a detached batch still waits for quiescence. Entries of a batch are out of
+// the usable list when it's detached, so only pops entered before that can
+// still read them:
+//  1. wait until the slot not in use has no pop, all its pops entered after
+//     the batch was detached
+//  2. flip the epoch so new pops go to that slot
+//  3. release the batch once the slot in use before the flip drains
+int mp_bucket_reclaim(mp_bucket_t *bucket)
+{
+    mp_slist_t *li = &bucket->usable;
+    if (bucket->pending == NULL)
+    {
+        bucket->pending = mp_slist_flush(&bucket->unusable);
+        if (bucket->pending == NULL)
+        {
+            return 0;
+        }
+        bucket->pending_slot = -1;
+    }
+    if (bucket->pending_slot < 0)
+    {
+        if (li->ref_cnt[(li->epoch & 1) ^ 1] != 0)
+        {
+            return 1;
+        }
+        bucket->pending_slot = (InterlockedIncrement(&li->epoch) - 1) & 1;
+    }
+    if (li->ref_cnt[bucket->pending_slot] != 0)
+    {
+        return 1;
+    }
+    mp_entry_chain_release(bucket, bucket->pending);
+    bucket->pending = NULL;
+    return 0;
+}
+
+#endif
+
+#ifdef USE_THREAD_CACHE
+// releases the magazines of depot, half of them (rounded up) for decay,
+// otherwise until bytes are released. The rest goes back to the depot.
+static size_t mp_depot_trim(mp_bucket_t *bucket, mp_magazine_t * volatile *depot, int decay, size_t bytes)
+{
+    int i;
+    int n;
+    size_t released;
+    mp_magazine_t *first;
+    mp_magazine_t *mag;
+    mp_magazine_t *next;
+    mp_magazine_t **prev;
+    first = InterlockedExchangePointer(depot, NULL);
+    n = 0;
+    for (mag = first; mag != NULL; mag = mag->next)
+    {
+        n++;
+    }
+    prev = &first;
+    for (i = 0; decay != 0 && i < n / 2; i++)
+    {
+        prev = &(*prev)->next;
+    }
+    released = 0;
+    mag = *prev;
+    while (mag != NULL && (decay != 0 || released < bytes))
+    {
+        next = mag->next;
+        for (i = 0; i < mag->rounds; i++)
+        {
+            mp_bucket_retire_entry(bucket, mag->round[i]);
+        }
+        released += (size_t)mag->rounds * bucket->block_size;
+        memory_free(mag);
+        mag = next;
+    }
+    *prev = mag;
+    if (first != NULL)
+    {
+        mp_depot_push_back(depot, first);
+    }
+    return released;
+}
+#endif
+
+static int mp_entry_slab_compare(const void *a, const void *b)
+{
+    mp_slab_t *x;
+    mp_slab_t *y;
+    x = MP_ENTRY_SLAB(*(mp_entry_t * const *)a);
+    y = MP_ENTRY_SLAB(*(mp_entry_t * const *)b);
+    return (x > y) - (x < y);
+}
+
+// retires up to quota entries of a batch sorted by slab, whole slabs that
+// drain with it go first. Retired entries are set to NULL.
+static int mp_trim_batch(mp_bucket_t *bucket, mp_entry_t **entries, int n, int quota)
+{
+    int i;
+    int j;
+    int k;
+    int pass;
+    int retired;
+    mp_slab_t *slab;
+    retired = 0;
+    for (pass = 0; pass < 2 && retired < quota; pass++)
+    {
+        for (i = 0; i < n && retired < quota; i = j)
+        {
+            if (entries[i] == NULL)
+            {
+                j = i + 1;
+                continue;
+            }
+            slab = MP_ENTRY_SLAB(entries[i]);
+            for (j = i + 1; j < n && entries[j] != NULL && MP_ENTRY_SLAB(entries[j]) == slab; j++);
+            // the last retire may unmap the slab, it isn't read after
+            if (pass == 0 && slab->retired + (j - i) != (int)slab->blocks)
+            {
+                continue;
+            }
+            for (k = i; k < j && (pass == 0 || retired < quota); k++)
+            {
+                mp_bucket_retire_entry(bucket, entries[k]);
+                entries[k] = NULL;
+                retired++;
+            }
+        }
+    }
+    return retired;
+}
+
+// releases cached entries of bucket, half of them (rounded up) for decay,
+// otherwise until bytes are released. The list is taken a batch per
+// exchange and the survivors are kept aside, so the head sees two CAS per
+// batch and one push of the whole chain at the end. Returns the bytes
+// released.
+static size_t mp_bucket_trim(mp_bucket_t *bucket, int decay, size_t bytes)
+{
+    int i;
+    int n;
+    int quota;
+    long batches;
+    size_t released;
+    mp_entry_t *first;
+    mp_entry_t *last;
+    mp_entry_t *entries[MP_TRIM_BATCH];
+    released = 0;
+#ifdef USE_THREAD_CACHE
+    released += mp_depot_trim(bucket, &bucket->full_magazines, decay, bytes);
+    mp_depot_trim(bucket, &bucket->empty_magazines, decay, (size_t)-1);
+#endif
+    first = NULL;
+    last = NULL;
+    // entries counts the blocks in use too, it bounds the walk when frees
+    // keep feeding the list
+    batches = mp_counter_read(&bucket->entries) / MP_TRIM_BATCH + 1;
+    while (batches-- > 0 && (decay != 0 || released < bytes))
+    {
+        n = mp_slist_pop_bulk(&bucket->usable, MP_TRIM_BATCH, entries);
+        if (n == 0)
+        {
+            break;
+        }
+        qsort(entries, n, sizeof(mp_entry_t *), mp_entry_slab_compare);
+        if (decay != 0)
+        {
+            quota = (n + 1) / 2;
+        }
+        else
+        {
+            quota = ((bytes - released) / bucket->block_size < (size_t)n)
+                ? (int)((bytes - released + bucket->block_size - 1) / bucket->block_size) : n;
+        }
+        released += (size_t)mp_trim_batch(bucket, entries, n, quota) * bucket->block_size;
+        for (i = 0; i < n; i++)
+        {
+            if (entries[i] == NULL)
+            {
+                continue;
+            }
+            if (!MP_ENTRY_UNSHARED(entries[i]))
+            {
+                mp_bucket_push_entry(bucket, entries[i]);
+                continue;
+            }
+            entries[i]->next = first;
+            first = entries[i];
+            if (last == NULL)
+            {
+                last = first;
+            }
+        }
+    }
+    if (first != NULL)
+    {
+        mp_slist_push_chain(&bucket->usable, first, last);
+    }
+    return released;
+}
+
+// largest buckets first, registered buckets last
+#if defined(USE_DECAY) || defined(MP_SLIST_TAGGED)
+static unsigned long long mp_tick_msec()
+{
+#ifdef WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+#endif
+
+#ifdef MP_SLIST_TAGGED
+// unmaps the slabs idle since the last round and makes the ones drained
+// since then idle, once per MP_DRAINED_GRACE_MSEC whoever calls it
+static void mp_pool_release_drained(memory_pool_t *pool)
+{
+    long long now;
+    long long since;
+    mp_slab_t *slab;
+    mp_slab_t *last;
+    now = (long long)mp_tick_msec();
+    since = pool->idle_since;
+    if (now - since < MP_DRAINED_GRACE_MSEC
+        || InterlockedCompareExchange64(&pool->idle_since, now, since) != since)
+    {
+        return;
+    }
+    slab = InterlockedExchangePointer(&pool->idle_slabs, NULL);
+    while (slab != NULL)
+    {
+        last = slab->next;
+        mp_slab_unmap(slab);
+        slab = last;
+    }
+    slab = InterlockedExchangePointer(&pool->drained_slabs, NULL);
+    if (slab != NULL)
+    {
+        for (last = slab; last->next != NULL; last = last->next);
+        mp_slab_list_push(&pool->idle_slabs, slab, last);
+    }
+}
+#endif
+
+size_t mp_pool_trim(memory_pool_t *pool, size_t bytes)
+{
+    int i;
+    size_t released;
+    mp_bucket_t *bucket;
+    released = mp_large_cache_trim(pool, 0, bytes);
+    for (i = MEMORY_POOL_BUCKETS_NUMBER - 1; i >= 0 && released < bytes; i--)
+    {
+        released += mp_bucket_trim(&pool->buckets[i], 0, bytes - released);
+    }
+    for (bucket = pool->next_register; bucket != NULL && released < bytes; bucket = bucket->next)
+    {
+        released += mp_bucket_trim(bucket, 0, bytes - released);
+    }
+#ifdef MP_SLIST_TAGGED
+    mp_pool_release_drained(pool);
+#endif
+    return released;
+}
+
+size_t mp_trim(size_t bytes)
+{
+    int i;
+    size_t released;
+    if (bytes == 0)
+    {
+        bytes = (size_t)-1;
+    }
+    released = 0;
+    for (i = 0; i < g_memory_pool_count && released < bytes; i++)
+    {
+        released += mp_pool_trim(&g_memory_pools[i], bytes - released);
+    }
+    return released;
+}
+
+#ifdef USE_DECAY
+#ifdef __linux__
+// "some avg10" of the memory pressure stall information, 0 without PSI.
+// Read with plain syscalls, the decay round takes no stdio lock.
+static double mp_memory_pressure()
+{
+    int fd;
+    ssize_t n;
+    char line[128];
+    fd = open("/proc/pressure/memory", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    n = read(fd, line, sizeof(line) - 1);
+    close(fd);
+    if (n <= 0)
+    {
+        return 0;
+    }
+    line[n] = '\0';
+    if (strncmp(line, "some avg10=", 11) != 0)
+    {
+        return 0;
+    }
+    return strtod(line + 11, NULL);
+}
+#endif
+
+// a bucket that refilled since the last round still needs what it has
+static void mp_pool_decay(memory_pool_t *pool)
+{
+    int i;
+    int refills;
+    mp_bucket_t *bucket;
+#ifdef __linux__
+    if (mp_memory_pressure() > MP_DECAY_PRESSURE)
+    {
+        mp_pool_trim(pool, (size_t)-1);
+        return;
+    }
+#endif
+    mp_large_cache_trim(pool, 1, 0);
+#ifdef MP_SLIST_TAGGED
+    mp_pool_release_drained(pool);
+#endif
+    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    {
+        bucket = &pool->buckets[i];
+        refills = bucket->refills;
+        if (refills == bucket->decay_refills)
+        {
+            mp_bucket_trim(bucket, 1, 0);
+        }
+        bucket->decay_refills = refills;
+    }
+    for (bucket = pool->next_register; bucket != NULL; bucket = bucket->next)
+    {
+        refills = bucket->refills;
+        if (refills == bucket->decay_refills)
+        {
+            mp_bucket_trim(bucket, 1, 0);
+        }
+        bucket->decay_refills = refills;
+    }
+}
+#endif
+
+#ifdef MP_POOL_THREAD
+// woken by the first free that defers an entry, reclaims bucket by bucket
+// and sleeps for good once nothing is pending. With USE_DECAY it also runs
+// a decay round every MP_DECAY_INTERVAL_MSEC.
+void *free_thread_proc(void *param)
+{
+    unsigned int wait;
+    int pending = 0;
+    memory_pool_t *pool = (memory_pool_t *)param;
+#ifdef USE_FREE_THREAD
+    int i;
+    mp_bucket_t *bucket;
+#endif
+#ifdef USE_DECAY
+    unsigned long long now;
+    unsigned long long decay_time;
+    decay_time = mp_tick_msec() + MP_DECAY_INTERVAL_MSEC;
+#endif
+    for (;;)
+    {
+#ifdef USE_FREE_THREAD
+        InterlockedExchange(&pool->require_free, 0);
+        pending = 0;
+        for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+        {
+            pending |= mp_bucket_reclaim(&pool->buckets[i]);
+        }
+        for (bucket = pool->next_register; bucket != NULL; bucket = bucket->next)
+        {
+            pending |= mp_bucket_reclaim(bucket);
+        }
+#endif
+
+        if (pool->terminate != 0)
+        {
+            break;
+        }
+        wait = (pending != 0) ? MP_RECLAIM_RETRY_MSEC : INFINITE;
+#ifdef USE_DECAY
+        now = mp_tick_msec();
+        if (now >= decay_time)
+        {
+            mp_pool_decay(pool);
+            decay_time = now + MP_DECAY_INTERVAL_MSEC;
+        }
+        if (wait > decay_time - now)
+        {
+            wait = (unsigned int)(decay_time - now);
+        }
+#endif
+        wait_event(&pool->reclaim_event, wait);
+    }
+    log_infof(("memory pool free thread exited.\n"));
+    return 0;
+}
+#endif
+
+#ifdef WIN32
 unsigned __int64 get_total_memroy()
 #else
 unsigned long get_total_memroy()
@@ -305,6 +2857,41 @@ unsigned long get_total_memroy()
 #endif
 }
 
+void mp_pool_init(memory_pool_t *pool, int node, unsigned int threshold)
+{
+    int i;
+    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    {
+        mp_bucket_init(&pool->buckets[i], pool, i, mp_bucket_block_size(i), threshold);
+    }
+	pool->next_register = NULL;
+    pool->node = node;
+    pool->refills = 0;
+    pool->large_cache = NULL;
+    pool->large_cached = 0;
+#ifdef USE_ADAPTIVE_THRESHOLD
+    pool->adapting = 0;
+    pool->budget = (unsigned long long)threshold * MEMORY_POOL_BUCKETS_NUMBER;
+#endif
+#ifdef MP_SLIST_TAGGED
+    pool->drained_slabs = NULL;
+    pool->idle_slabs = NULL;
+    pool->idle_since = (long long)mp_tick_msec();
+#endif
+#ifdef USE_FREE_THREAD
+    pool->require_free = 0;
+#endif
+#ifdef MP_POOL_THREAD
+    pool->terminate = 0;
+    init_event(&pool->reclaim_event);
+
+    pool->free_thread = create_thread(free_thread_proc, pool);
+#endif
+}
+
+// the budget is split over the buckets of every node
+static volatile int g_mp_init_count = 0;
+
 void mp_init(int usable_percents, int min_usable)
 {
     int i;
@@ -320,75 +2907,377 @@ void mp_init(int usable_percents, int min_usable)
     {
         max_usable = min_usable;
     }
-    threshold = max_usable / MEMORY_POOL_BUCKETS_NUMBER;
+#ifdef USE_NUMA_POOLS
+    init_numa_topology();
+    g_memory_pool_count = get_numa_node_count();
+#else
+    g_memory_pool_count = 1;
+#endif
+    threshold = max_usable / MEMORY_POOL_BUCKETS_NUMBER / g_memory_pool_count;
     if (threshold > 0x7fffffff)
     {
         threshold = 0x7fffffff;
     }
-    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+#ifdef USE_THREAD_CACHE
+    create_tls_key(&g_thread_cache_key, mp_thread_cache_destroy);
+#endif
+#ifdef MP_LATENCY_HISTOGRAM
+    create_tls_key(&g_latency_key, mp_thread_latency_exit);
+#endif
+    for (i = 0; i < g_memory_pool_count; i++)
     {
-        mp_bucket_init(&g_memory_pool.buckets[i], 1 << i, (unsigned int)threshold);
+        mp_pool_init(&g_memory_pools[i], i, (unsigned int)threshold);
     }
-	g_memory_pool.next_register = NULL;
-    g_memory_pool.require_free = 0;
-    init_event(&g_memory_pool.termin_event);
+    InterlockedIncrement(&g_mp_init_count);
+}
 
-    g_memory_pool.free_thread = create_thread(free_thread_proc, NULL);
+int mp_init_count()
+{
+    return g_mp_init_count;
 }
 
+// registered buckets belong to the pool of the first node
 void mp_register_bucket(mp_bucket_t *bucket, int block_size, unsigned int threshold)
 {
-	mp_bucket_init(bucket, block_size, threshold);
 	mp_bucket_t *first;
+	mp_bucket_init(bucket, &g_memory_pools[0], -1, block_size, threshold);
 	for (;;) {
-		first = g_memory_pool.next_register;
+		first = g_memory_pools[0].next_register;
 		bucket->next = first;
-		if (first == InterlockedCompareExchangePointer(&g_memory_pool.next_register,
-			first,
-			bucket))
+		if (first == InterlockedCompareExchangePointer(&g_memory_pools[0].next_register,
+			bucket,
+			first))
 		{
 			break;
 		}
 	}
 }
 
-void mp_clear_register_bucket()
+void mp_pool_stop(memory_pool_t *pool)
+{
+#ifdef MP_POOL_THREAD
+    pool->terminate = 1;
+    set_event(&pool->reclaim_event);
+    wait_thread(pool->free_thread);
+    close_event(&pool->reclaim_event);
+#endif
+}
+
+void mp_pool_clear(memory_pool_t *pool)
 {
+    int i;
 	mp_bucket_t *bucket;
-	bucket = g_memory_pool.next_register;
-	while (bucket != NULL)
+    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    {
+        mp_bucket_clear(&pool->buckets[i]);
+    }
+	for (bucket = pool->next_register; bucket != NULL; bucket = bucket->next)
 	{
 		mp_bucket_clear(bucket);
-		bucket = bucket->next;
 	}
+#ifdef MP_SLIST_TAGGED
+    while (pool->drained_slabs != NULL)
+    {
+        mp_slab_t *slab = pool->drained_slabs;
+        pool->drained_slabs = slab->next;
+        mp_slab_unmap(slab);
+    }
+    while (pool->idle_slabs != NULL)
+    {
+        mp_slab_t *slab = pool->idle_slabs;
+        pool->idle_slabs = slab->next;
+        mp_slab_unmap(slab);
+    }
+#endif
+    mp_large_cache_trim(pool, 0, (size_t)-1);
 }
 
 void mp_clear()
 {
     int i;
-    set_event(&g_memory_pool.termin_event);
-    wait_thread(g_memory_pool.free_thread);
-    close_event(&g_memory_pool.termin_event);
-    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    for (i = 0; i < g_memory_pool_count; i++)
     {
-        mp_bucket_clear(&g_memory_pool.buckets[i]);
+        mp_pool_stop(&g_memory_pools[i]);
     }
-	mp_clear_register_bucket();
+#ifdef USE_THREAD_CACHE
+    mp_thread_cache_flush();
+    delete_tls_key(g_thread_cache_key);
+#endif
+#ifdef USE_REMOTE_FREE
+    mp_owner_clear();
+#endif
+#ifdef MP_LATENCY_HISTOGRAM
+    delete_tls_key(g_latency_key);
+    t_latency = NULL;
+    while (g_latency_threads != NULL)
+    {
+        mp_thread_latency_t *t = g_latency_threads;
+        g_latency_threads = t->next;
+        memory_free(t);
+    }
+    memset(g_latency_exited, 0, sizeof(g_latency_exited));
+#endif
+    for (i = 0; i < g_memory_pool_count; i++)
+    {
+        mp_pool_clear(&g_memory_pools[i]);
+    }
+#ifdef MP_HEADERLESS_SMALL
+    mp_pagemap_clear();
+#endif
 	check_memory();
 }
 
-void mp_print()
+memory_pool_t *mp_pool_create(size_t budget, int node)
+{
+    memory_pool_t *pool;
+    size_t threshold;
+    // pages keep the cache line layout of the pool and its buckets
+    pool = (memory_pool_t *)page_alloc_node(sizeof(memory_pool_t), node, 'opfl');
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    threshold = budget / MEMORY_POOL_BUCKETS_NUMBER;
+    if (threshold > 0x7fffffff)
+    {
+        threshold = 0x7fffffff;
+    }
+    mp_pool_init(pool, node, (unsigned int)threshold);
+    return pool;
+}
+
+void mp_pool_destroy(memory_pool_t *pool)
+{
+    mp_pool_stop(pool);
+    mp_pool_clear(pool);
+    page_free(pool, sizeof(memory_pool_t), 'opfl');
+}
+
+memory_pool_t *mp_default_pool()
+{
+    return mp_caller_pool();
+}
+
+void *mp_pool_malloc(memory_pool_t *pool, size_t size)
+{
+    int idx;
+    idx = mp_lookup_bucket(size > 0xffffffff ? 0xffffffff : (unsigned int)size);
+    if (idx >= MEMORY_POOL_BUCKETS_NUMBER)
+    {
+        return mp_large_malloc(pool, size, 'pmfl', NULL);
+    }
+    return mp_bucket_malloc(&pool->buckets[idx], size, 'pmfl');
+}
+
+void mp_pool_free(memory_pool_t *pool, void *p)
+{
+#ifndef NDEBUG
+    mp_slab_t *slab;
+    mp_bucket_t *bucket;
+    bucket = NULL;
+    mp_block_entry(&bucket, &slab, p);
+    assert(slab->pool == pool);
+#else
+    (void)pool;
+#endif
+    mp_bucket_free(NULL, p);
+}
+
+// the dumps go through the log ring a line at a time, so they take no stdio
+// lock and lines of other threads don't cut into them
+typedef struct
+{
+    char text[512];
+    size_t length;
+} mp_print_line_t;
+
+static void mp_line_append(mp_print_line_t *line, const char *fmt, ...)
+{
+    int n;
+    va_list args;
+    va_start(args, fmt);
+    n = vsnprintf(line->text + line->length, sizeof(line->text) - line->length, fmt, args);
+    va_end(args);
+    if (n > 0)
+    {
+        line->length += (size_t)n;
+        if (line->length >= sizeof(line->text))
+        {
+            line->length = sizeof(line->text) - 1;
+        }
+    }
+}
+
+static void mp_line_flush(mp_print_line_t *line)
+{
+    if (line->length != 0)
+    {
+        log_infof(("%s\n", line->text));
+    }
+    line->length = 0;
+    line->text[0] = 0;
+}
+
+void mp_pool_print(memory_pool_t *pool)
 {
     int i;
-    printf("memory pool bucket entries:\n");
+    int slabs = 0;
+    mp_print_line_t line;
+    line.length = 0;
+    line.text[0] = 0;
+    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    {
+        slabs += pool->buckets[i].slabs;
+    }
+    log_infof(("memory pool node %d slabs: %d, refills: %d, large cached: %dK\n", 
+        pool->node, 
+        slabs, 
+        pool->refills, 
+        pool->large_cached * (PAGE_ALLOC_GRANULARITY >> 10)));
+    log_infof(("memory pool bucket entries:\n"));
+    for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
+    {
+        mp_line_append(&line, "[%6u] = %8d, ", 
+            pool->buckets[i].block_size,
+            mp_counter_sum(&pool->buckets[i].entries));
+        if ((i+1) % 4 == 0)
+        {
+            mp_line_flush(&line);
+        }
+    }
+    mp_line_flush(&line);
+#ifdef USE_ADAPTIVE_THRESHOLD
+    log_infof(("memory pool bucket thresholds (KB):\n"));
     for (i = 0; i < MEMORY_POOL_BUCKETS_NUMBER; i++)
     {
-        printf("[%2d] = %10d, ", 
-            i,
-            g_memory_pool.buckets[i].entries);
+        mp_line_append(&line, "[%6u] = %8u, ", 
+            pool->buckets[i].block_size,
+            pool->buckets[i].threshold >> 10);
         if ((i+1) % 4 == 0)
         {
-            printf("\n");
+            mp_line_flush(&line);
+        }
+    }
+    mp_line_flush(&line);
+#endif
+}
+
+#ifdef MP_LATENCY_HISTOGRAM
+void mp_latency_reset()
+{
+    int i;
+    int j;
+    mp_bucket_t *bucket;
+    mp_thread_latency_t *t;
+    for (i = 0; i < g_memory_pool_count; i++)
+    {
+        for (j = 0; j < MEMORY_POOL_BUCKETS_NUMBER; j++)
+        {
+            memset(g_memory_pools[i].buckets[j].latency, 0, sizeof(bucket->latency));
+        }
+        for (bucket = g_memory_pools[i].next_register; bucket != NULL; bucket = bucket->next)
+        {
+            memset(bucket->latency, 0, sizeof(bucket->latency));
+        }
+    }
+    for (t = g_latency_threads; t != NULL; t = t->next)
+    {
+        memset(t->ops, 0, sizeof(t->ops));
+    }
+    memset(g_latency_exited, 0, sizeof(g_latency_exited));
+}
+
+static void mp_histogram_print(mp_print_line_t *line, const char *name, const mp_histogram_t *h)
+{
+    int i;
+    unsigned long long total = 0;
+    for (i = 0; i < MP_LATENCY_SLOTS; i++)
+    {
+        total += (unsigned int)h->count[i];
+    }
+    mp_line_append(line, "%s n=%llu p50=%llu p99=%llu p999=%llu max=%llu",
+        name,
+        total,
+        mp_histogram_percentile(h, 50),
+        mp_histogram_percentile(h, 99),
+        mp_histogram_percentile(h, 99.9),
+        mp_histogram_percentile(h, 100));
+}
+
+void mp_latency_print()
+{
+    int i;
+    int j;
+    int op;
+    mp_bucket_t *bucket;
+    mp_thread_latency_t *t;
+    mp_histogram_t h;
+    mp_print_line_t line;
+    static const char *op_names[MP_LATENCY_OPS] = { "malloc", "free" };
+    line.length = 0;
+    line.text[0] = 0;
+    log_infof(("memory pool latency (cycles, 1 of %d sampled):\n", MP_LATENCY_SAMPLE_RATE));
+    for (i = 0; i < g_memory_pool_count; i++)
+    {
+        for (j = 0; j < MEMORY_POOL_BUCKETS_NUMBER; j++)
+        {
+            bucket = &g_memory_pools[i].buckets[j];
+            if (mp_histogram_percentile(&bucket->latency[MP_LATENCY_MALLOC], 100) == 0
+                && mp_histogram_percentile(&bucket->latency[MP_LATENCY_FREE], 100) == 0)
+            {
+                continue;
+            }
+            mp_line_append(&line, "node %d [%6u] ", i, bucket->block_size);
+            for (op = 0; op < MP_LATENCY_OPS; op++)
+            {
+                mp_histogram_print(&line, op_names[op], &bucket->latency[op]);
+                if (op + 1 < MP_LATENCY_OPS)
+                {
+                    mp_line_append(&line, ", ");
+                }
+            }
+            mp_line_flush(&line);
+        }
+    }
+    for (t = g_latency_threads; t != NULL; t = t->next)
+    {
+        if (t->exited)
+        {
+            continue;
+        }
+        mp_line_append(&line, "thread %d ", t->id);
+        for (op = 0; op < MP_LATENCY_OPS; op++)
+        {
+            mp_histogram_print(&line, op_names[op], &t->ops[op]);
+            if (op + 1 < MP_LATENCY_OPS)
+            {
+                mp_line_append(&line, ", ");
+            }
+        }
+        mp_line_flush(&line);
+    }
+    mp_line_append(&line, "all threads ");
+    for (op = 0; op < MP_LATENCY_OPS; op++)
+    {
+        mp_all_threads_latency(op, &h);
+        mp_histogram_print(&line, op_names[op], &h);
+        if (op + 1 < MP_LATENCY_OPS)
+        {
+            mp_line_append(&line, ", ");
         }
     }
+    mp_line_flush(&line);
+}
+#endif
+
+void mp_print()
+{
+    int i;
+    for (i = 0; i < g_memory_pool_count; i++)
+    {
+        mp_pool_print(&g_memory_pools[i]);
+    }
+#ifdef MP_LATENCY_HISTOGRAM
+    mp_latency_print();
+#endif
 }
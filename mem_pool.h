@@ -9,58 +9,373 @@ extern "C"
 #include <stdlib.h>
 #include "thread_defs.h"
 #include "event.h"
+#include "numa_defs.h"
 
+// MP_SLIST_TAGGED replaces the refer count protocol of mp_slist_t with a
+// {head, tag} pair swapped by one double word CAS (cmpxchg16b, build with
+// -mcx16 on x86_64). Pops become a single CAS loop and entries never have
+// to be deferred, so there is no free thread. A pop may still read the
+// next field of an entry that another thread has just released, so in this
+// mode drained slabs stay mapped and are carved again by later refills.
+//#define MP_SLIST_TAGGED
+
+// MP_HEADERLESS_SMALL drops the entry header of blocks up to
+// MP_HEADERLESS_MAX_SIZE bytes, a free finds slab, bucket and size of the
+// block through a page map instead. It needs MP_SLIST_TAGGED, the refer
+// count protocol writes into entries which may be handed out already.
+//#define MP_HEADERLESS_SMALL
+#define MP_HEADERLESS_MAX_SIZE 64
+
+#if defined(MP_HEADERLESS_SMALL) && !defined(MP_SLIST_TAGGED)
+#error MP_HEADERLESS_SMALL requires MP_SLIST_TAGGED
+#endif
+
+#ifndef MP_SLIST_TAGGED
 #define USE_FREE_THREAD
+#endif
+#define USE_THREAD_CACHE
+// one pool per NUMA node, mp_malloc serves from the pool of the caller's node
+#define USE_NUMA_POOLS
+
+// USE_REMOTE_FREE gives a block freed by another thread back to the thread
+// that allocated it: the entry header records the owner, the freeing thread
+// collects blocks of one owner per bucket and splices them into the owner's
+// queue with one CAS, and the owner takes the whole queue with one exchange
+// once its magazines run dry. Headerless blocks have no owner.
+#ifdef USE_THREAD_CACHE
+#define USE_REMOTE_FREE
+#endif
+
+// MP_LATENCY_HISTOGRAM times one mp_bucket_malloc/mp_bucket_free out of
+// MP_LATENCY_SAMPLE_RATE with the cycle counter and counts it in a
+// histogram of its bucket and of the calling thread. Without it nothing
+// is compiled in.
+//#define MP_LATENCY_HISTOGRAM
+#define MP_LATENCY_SAMPLE_RATE 64
+
+// USE_ADAPTIVE_THRESHOLD moves the budget of a pool between its buckets:
+// every MP_ADAPT_REFILLS refills a bucket gets what it held at its peak
+// plus a slab, and the rest goes to the buckets that released blocks over
+// their threshold, in proportion to the bytes released. Without it every
+// bucket keeps an equal share.
+#define USE_ADAPTIVE_THRESHOLD
+#define MP_ADAPT_REFILLS 64
+
+// USE_DECAY gives cached entries back once a bucket stops needing them: a
+// bucket that didn't refill for MP_DECAY_INTERVAL_MSEC releases half of
+// the entries on its usable list and in its depot. On Linux everything is
+// released while memory pressure (PSI "some avg10") is above
+// MP_DECAY_PRESSURE percent. Slabs go back to the system when their last
+// entry is released, in tagged mode their pages are reset instead.
+#define USE_DECAY
+#define MP_DECAY_INTERVAL_MSEC 1000
+#define MP_DECAY_PRESSURE 10
+
+#if defined(USE_FREE_THREAD) || defined(USE_DECAY)
+#define MP_POOL_THREAD
+#endif
+
+// sizes beyond the largest bucket get a mapping of their own. A pool keeps
+// up to MP_LARGE_CACHE_SIZE bytes of freed mappings for later blocks of up
+// to the same size. Mappings of MP_HUGE_PAGE_SIZE and more are backed by
+// huge pages: MP_LARGE_HUGE_PAGES 0 never, 1 transparent ones, 2 explicit
+// ones (MAP_HUGETLB, MEM_LARGE_PAGES) falling back to transparent ones.
+#define MP_LARGE_CACHE_SIZE 0x4000000
+#define MP_LARGE_HUGE_PAGES 1
+
+struct _mp_slab;
+struct _memory_pool;
 
 typedef struct _mp_entry
 {
     struct _mp_entry *next;
+    struct _mp_slab *slab;
     unsigned int size;
     volatile int ref_cnt;
     volatile int owned;
+#ifdef USE_REMOTE_FREE
+    int owner;              // id of the allocating thread's cache, 0 for none
+#endif
 } mp_entry_t;
 
+#define MP_SLAB_MIN_BLOCKS  8
+#define MP_SLAB_MAX_SIZE    0x200000
+
+// buckets refill by carving a slab of pages into many entries. A slab starts
+// draining once one of its entries is released over threshold: from then on
+// its entries are retired instead of reused, and the pages go back to the
+// system when the last one is retired.
+typedef struct _mp_slab
+{
+    struct _mp_slab *next;
+    struct _mp_bucket_t *bucket;   // NULL for a large block
+    struct _memory_pool *pool;
+    size_t size;
+    unsigned int blocks;
+    volatile int retired;
+    unsigned long tag;
+} mp_slab_t;
+
+#ifdef _MSC_VER
+#define MP_ALIGNED(n) __declspec(align(n))
+#else
+#define MP_ALIGNED(n) __attribute__((aligned(n)))
+#endif
+#define MP_CACHE_LINE_SIZE 64
+// starts a field on its own cache line, put it in front of the declaration
+#define MP_CACHE_ALIGNED MP_ALIGNED(MP_CACHE_LINE_SIZE)
+
+// a counter split into cache line sized shards. A thread adds to the shard
+// of the cpu it first ran on and folds the shard into total once it has
+// moved by batch, so total lags the exact sum by less than shards * batch.
+#define MP_COUNTER_SHARDS 16
+
+typedef struct MP_ALIGNED(MP_CACHE_LINE_SIZE)
+{
+    volatile int value;
+} mp_counter_shard_t;
+
 typedef struct
+{
+    mp_counter_shard_t shard[MP_COUNTER_SHARDS];
+    volatile int total;
+    int batch;
+} mp_counter_t;
+
+#ifdef MP_SLIST_TAGGED
+#if defined(_WIN64) || defined(__x86_64__) || defined(__aarch64__)
+#define MP_SLIST_ALIGN 16
+#else
+#define MP_SLIST_ALIGN 8
+#endif
+
+typedef struct MP_ALIGNED(MP_SLIST_ALIGN)
 {
     mp_entry_t * volatile next;
-    volatile int ref_cnt;
+    volatile size_t tag;    // bumped by every pop, defeats ABA
+} mp_slist_t;
+#else
+// pops register in ref_cnt[epoch & 1]. Flipping the epoch closes one slot to
+// new pops, the reclaimer only has to see that slot drain instead of waiting
+// for a moment when no pop at all is running.
+// Only pops touch ref_cnt, so pushes CAS next on a line of its own.
+typedef struct
+{
+    mp_entry_t * volatile next;
+    MP_CACHE_ALIGNED volatile int ref_cnt[2];
+    volatile int epoch;
 } mp_slist_t;
+#endif
+
+#ifdef USE_THREAD_CACHE
+#define MP_MAGAZINE_SIZE 32
 
+// a magazine is a per-thread stack of free entries of one bucket, it's
+// exchanged as a whole with the bucket depot.
+typedef struct _mp_magazine
+{
+    struct _mp_magazine *next;
+    int rounds;
+    mp_entry_t *round[MP_MAGAZINE_SIZE];
+} mp_magazine_t;
+#endif
+
+#ifdef MP_LATENCY_HISTOGRAM
+// log-linear slots: values below 2^MP_LATENCY_SUB_BITS exactly, above that
+// 2^MP_LATENCY_SUB_BITS slots per power of two up to 2^MP_LATENCY_MAX_LG.
+#define MP_LATENCY_SUB_BITS 3
+#define MP_LATENCY_MAX_LG   40
+#define MP_LATENCY_SLOTS    ((MP_LATENCY_MAX_LG - MP_LATENCY_SUB_BITS + 1) << MP_LATENCY_SUB_BITS)
+
+enum
+{
+    MP_LATENCY_MALLOC,
+    MP_LATENCY_FREE,
+    MP_LATENCY_OPS
+};
+
+typedef struct
+{
+    volatile int count[MP_LATENCY_SLOTS];
+} mp_histogram_t;
+#endif
+
+// the first cache line holds what every malloc and free reads but nobody
+// writes after init, each field written concurrently starts a line of its
+// own so that neither neighbors nor the read mostly part bounce with it.
 typedef struct _mp_bucket_t
 {
 	struct _mp_bucket_t *next;
-    mp_slist_t usable;
-#ifdef USE_FREE_THREAD
-    mp_slist_t unusable;
-#endif
+    struct _memory_pool *pool;
+    int index;              // in pool->buckets, -1 for registered buckets
     unsigned int block_size;
-    volatile int entries;
+    unsigned int header_size;
+    unsigned int stride;
+    unsigned int slab_blocks;
     unsigned int threshold;
+    MP_CACHE_ALIGNED mp_slist_t usable;
+#ifdef USE_FREE_THREAD
+    MP_CACHE_ALIGNED mp_slist_t unusable;
+    mp_entry_t *pending;    // detached from unusable, waiting for quiescence
+    int pending_slot;
+#endif
+#ifdef USE_THREAD_CACHE
+    MP_CACHE_ALIGNED mp_magazine_t * volatile full_magazines;
+    mp_magazine_t * volatile empty_magazines;
+#endif
+    MP_CACHE_ALIGNED volatile int slabs;
+#ifdef USE_DECAY
+    volatile int refills;
+    int decay_refills;      // refills at the last decay round
+#endif
+#ifdef USE_ADAPTIVE_THRESHOLD
+    // since the last rebalance of the pool
+    volatile int misses;
+    volatile int releases;
+    volatile int high_water;
+#endif
+    mp_counter_t entries;   // shards and total are line aligned already
+#ifdef MP_LATENCY_HISTOGRAM
+    mp_histogram_t latency[MP_LATENCY_OPS];
+#endif
 } mp_bucket_t;
 
-#define MEMORY_POOL_BUCKETS_NUMBER  20
+// size classes: 1, 2, 4, 8, 16, then 4 classes for every power of two,
+// 20, 24, 28, 32, 40, 48, 56, 64, 80, ... up to 512K
+#define MP_SIZE_CLASS_POW2_NUMBER   5
+#define MP_SIZE_CLASS_GROUP_LG      2
+#define MP_SIZE_CLASS_MAX_LG        19
+#define MEMORY_POOL_BUCKETS_NUMBER  (MP_SIZE_CLASS_POW2_NUMBER + \
+    ((MP_SIZE_CLASS_MAX_LG - MP_SIZE_CLASS_POW2_NUMBER + 1) << MP_SIZE_CLASS_GROUP_LG))
+#define MP_SIZE_CLASS_MAX_SIZE      (1u << MP_SIZE_CLASS_MAX_LG)
 
-typedef struct
+// mp_lookup_bucket as a constant expression, for sizes known at compile
+// time. MEMORY_POOL_BUCKETS_NUMBER if no bucket fits.
+#define MP_CONST_LG2_2(x)   ((x) >= 0x2 ? 1 : 0)
+#define MP_CONST_LG2_4(x)   ((x) >= 0x4 ? 2 + MP_CONST_LG2_2((x) >> 2) : MP_CONST_LG2_2(x))
+#define MP_CONST_LG2_8(x)   ((x) >= 0x10 ? 4 + MP_CONST_LG2_4((x) >> 4) : MP_CONST_LG2_4(x))
+#define MP_CONST_LG2_16(x)  ((x) >= 0x100 ? 8 + MP_CONST_LG2_8((x) >> 8) : MP_CONST_LG2_8(x))
+#define MP_CONST_LG2(x)     ((x) >= 0x10000 ? 16 + MP_CONST_LG2_16((x) >> 16) : MP_CONST_LG2_16(x))
+#define MP_SIZE_CLASS(size) \
+    ((size_t)(size) <= 1 ? 0 : \
+    (size_t)(size) <= (1u << (MP_SIZE_CLASS_POW2_NUMBER - 1)) ? \
+        MP_CONST_LG2((unsigned int)(size) - 1) + 1 : \
+    (size_t)(size) > MP_SIZE_CLASS_MAX_SIZE ? MEMORY_POOL_BUCKETS_NUMBER : \
+    (int)(MP_SIZE_CLASS_POW2_NUMBER \
+        + ((MP_CONST_LG2((unsigned int)(size) - 1) - (MP_SIZE_CLASS_POW2_NUMBER - 1)) << MP_SIZE_CLASS_GROUP_LG) \
+        + (((unsigned int)(size) - 1) >> (MP_CONST_LG2((unsigned int)(size) - 1) - MP_SIZE_CLASS_GROUP_LG)) \
+        - (1 << MP_SIZE_CLASS_GROUP_LG)))
+
+#ifdef USE_NUMA_POOLS
+#define MP_POOL_NODES_NUMBER MAX_NUMA_NODES
+#else
+#define MP_POOL_NODES_NUMBER 1
+#endif
+
+typedef struct _memory_pool
 {
-    // 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, ...
     mp_bucket_t buckets[MEMORY_POOL_BUCKETS_NUMBER];
 	mp_bucket_t *next_register;
-#ifdef USE_FREE_THREAD
+    int node;
+#ifdef MP_POOL_THREAD
     thread_handle_t free_thread;
-    volatile int require_free;
-    event_t termin_event;
+    volatile int terminate;
+    event_t reclaim_event;
+#endif
+#ifdef USE_FREE_THREAD
+    MP_CACHE_ALIGNED volatile int require_free;     // set by any free over threshold
+#endif
+    MP_CACHE_ALIGNED volatile int refills;
+#ifdef USE_ADAPTIVE_THRESHOLD
+    volatile int adapting;
+    unsigned long long budget;  // bytes, shared by the size class buckets
 #endif
+#ifdef MP_SLIST_TAGGED
+    MP_CACHE_ALIGNED mp_slab_t * volatile drained_slabs;
+    mp_slab_t * volatile idle_slabs;    // drained before the last release round
+    volatile long long idle_since;      // msec tick of that round
+#endif
+    MP_CACHE_ALIGNED mp_slab_t * volatile large_cache;
+    volatile int large_cached;  // in PAGE_ALLOC_GRANULARITY units
 } memory_pool_t;
 
 void mp_init(int usable_percents, int min_usable);
+int mp_lookup_bucket(unsigned int size);
+unsigned int mp_bucket_block_size(int idx);
 void mp_register_bucket(mp_bucket_t *bucket, int block_size, unsigned int threshold);
+// mp_init calls so far, buckets registered before the last one are forgotten
+int mp_init_count();
 void *mp_bucket_malloc(mp_bucket_t *bucket, size_t size, unsigned long tag);
+// a block of size class idx from the caller's pool, no size lookup
+void *mp_class_malloc(int idx, unsigned long tag);
+// a block at a multiple of align, a power of two, freed with mp_bucket_free.
+// NULL if bucket (NULL picks one by size) has no room for the alignment.
+void *mp_bucket_malloc_aligned(mp_bucket_t *bucket, size_t align, size_t size, unsigned long tag);
 void mp_bucket_free(mp_bucket_t *bucket, void *p);
+// bulk versions detach or splice a whole chain of the bucket with one CAS
+int mp_bucket_malloc_bulk(mp_bucket_t *bucket, size_t size, int n, void **p, unsigned long tag);
+void mp_bucket_free_bulk(mp_bucket_t *bucket, int n, void **p);
+// bytes the block p can hold, at least the size it was allocated with
+size_t mp_usable_size(void *p);
+// keeps p while size fits its block, otherwise moves it to a block from
+// bucket (NULL picks one by size). Size 0 frees p and returns NULL.
+void *mp_bucket_realloc(mp_bucket_t *bucket, void *p, size_t size, unsigned long tag);
+void *mp_bucket_calloc(mp_bucket_t *bucket, size_t n, size_t size, unsigned long tag);
+#ifdef MP_HEADERLESS_SMALL
+// whether p is a block of the pools, p may come from anywhere
+int mp_block_owned(void *p);
+#endif
 void mp_clear();
 void mp_print();
 
+// pools of their own, each with its buckets, budget (bytes, split over the
+// buckets), large cache and reclaim thread. mp_malloc serves from the node
+// pools set up by mp_init, mp_default_pool is the one of the caller. Created
+// pools live between mp_init and mp_clear and bypass the thread caches. A
+// pool is destroyed once all of its blocks are freed, mp_free or
+// mp_bucket_free find the pool of a block by themselves.
+memory_pool_t *mp_pool_create(size_t budget, int node);
+void mp_pool_destroy(memory_pool_t *pool);
+memory_pool_t *mp_default_pool();
+void *mp_pool_malloc(memory_pool_t *pool, size_t size);
+// mp_free does the same, this one asserts in debug builds that p is of pool
+void mp_pool_free(memory_pool_t *pool, void *p);
+size_t mp_pool_trim(memory_pool_t *pool, size_t bytes);
+void mp_pool_print(memory_pool_t *pool);
+
+// releases cached entries of every node pool until at least bytes are gone, 0
+// releases all of them. Returns the bytes released. Magazines of threads
+// stay, a thread gives its own back with mp_thread_cache_flush.
+size_t mp_trim(size_t bytes);
+#ifdef USE_THREAD_CACHE
+// give back the magazines of calling thread, it's done automatically on thread exit.
+void mp_thread_cache_flush();
+#endif
+
+#ifdef MP_LATENCY_HISTOGRAM
+// op is MP_LATENCY_MALLOC or MP_LATENCY_FREE, histograms count cycles.
+void mp_bucket_latency(mp_bucket_t *bucket, int op, mp_histogram_t *h);
+// samples of the calling thread, or of every thread that ever sampled
+void mp_thread_latency(int op, mp_histogram_t *h);
+void mp_all_threads_latency(int op, mp_histogram_t *h);
+unsigned long long mp_histogram_percentile(const mp_histogram_t *h, double percent);
+void mp_latency_reset();
+void mp_latency_print();
+#endif
+
 static __inline void *mp_malloc(size_t n) { return mp_bucket_malloc(NULL, n, 'pmfl'); }
+#ifdef __GNUC__
+// constant sizes pick their bucket at compile time, (mp_malloc) is the function
+#define mp_malloc(n) \
+    ((__builtin_constant_p(n) && MP_SIZE_CLASS(n) < MEMORY_POOL_BUCKETS_NUMBER) ? \
+        mp_class_malloc(MP_SIZE_CLASS(n), 'pmfl') : (mp_malloc)(n))
+#endif
 static __inline void mp_free(void *p) { mp_bucket_free(NULL, p); }
+static __inline void *mp_memalign(size_t align, size_t n) { return mp_bucket_malloc_aligned(NULL, align, n, 'pmfl'); }
+static __inline void *mp_realloc(void *p, size_t n) { return mp_bucket_realloc(NULL, p, n, 'pmfl'); }
+static __inline void *mp_calloc(size_t n, size_t size) { return mp_bucket_calloc(NULL, n, size, 'pmfl'); }
+static __inline int mp_malloc_bulk(size_t size, int n, void **p) { return mp_bucket_malloc_bulk(NULL, size, n, p, 'pmfl'); }
+static __inline void mp_free_bulk(int n, void **p) { mp_bucket_free_bulk(NULL, n, p); }
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,180 @@
+#ifndef MEM_POOL_HPP_5B0E27C4_8D6A_4f3e_9C21_7F4A90D3E6B1
+#define MEM_POOL_HPP_5B0E27C4_8D6A_4f3e_9C21_7F4A90D3E6B1
+
+// typed front end of the memory pool for C++ code.
+//
+// alloc<Size>() resolves the size class of a constant size at compile time.
+//
+// object_pool<T> and pool_allocator<T> serve T sized blocks from a bucket
+// registered for that size on first use, shared by every type of the same
+// size and alignment. Registered buckets are never unregistered, so they
+// live in function statics, and mp_clear forgets them: the first use after
+// the next mp_init registers them again. mp_init has to run before the
+// first allocation, mp_clear after the last free.
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "mem_pool.h"
+
+#ifndef LFMP_TYPED_BUCKET_THRESHOLD
+// bytes of free blocks a typed bucket keeps before giving slabs back
+#define LFMP_TYPED_BUCKET_THRESHOLD 0x400000
+#endif
+
+namespace lfmp
+{
+
+// blocks are aligned to the entry header (4 pointers) or, for small
+// headerless blocks, to their size rounded to a pointer
+const std::size_t max_block_align = 4 * sizeof(void *);
+
+// mp_lookup_bucket at compile time
+constexpr int size_class(std::size_t size)
+{
+    return MP_SIZE_CLASS(size);
+}
+
+// mp_malloc(Size) with the bucket picked at compile time
+template <std::size_t Size>
+inline void *alloc()
+{
+    static_assert(size_class(Size) < MEMORY_POOL_BUCKETS_NUMBER, "larger than the largest size class");
+    return mp_class_malloc(size_class(Size), 'pmfl');
+}
+
+template <std::size_t Size, std::size_t Align>
+class typed_bucket
+{
+public:
+    static_assert(Align <= max_block_align, "alignment beyond what the pool blocks guarantee");
+
+    // a multiple of Align keeps every block of the slab aligned
+    static const std::size_t block_size = (Size + Align - 1) / Align * Align;
+
+    static mp_bucket_t *get()
+    {
+        static mp_bucket_t bucket;
+        // mp_init_count of the registration, 0 before the first one
+        static std::atomic<int> registered(0);
+        static std::mutex lock;
+        int count = mp_init_count();
+        if (registered.load(std::memory_order_acquire) != count)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (registered.load(std::memory_order_relaxed) != count)
+            {
+                mp_register_bucket(&bucket, (int)block_size, LFMP_TYPED_BUCKET_THRESHOLD);
+                registered.store(count, std::memory_order_release);
+            }
+        }
+        return &bucket;
+    }
+};
+
+template <class T>
+class object_pool
+{
+public:
+    typedef T value_type;
+    typedef typed_bucket<sizeof(T), alignof(T)> bucket_type;
+
+    // raw block for one T, throws std::bad_alloc like operator new
+    static void *allocate()
+    {
+        void *p = mp_bucket_malloc(bucket_type::get(), sizeof(T), 'jbol');
+        if (p == NULL)
+        {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    static void deallocate(void *p)
+    {
+        mp_bucket_free(bucket_type::get(), p);
+    }
+
+    template <class... Args>
+    static T *emplace(Args&&... args)
+    {
+        void *p = allocate();
+        try
+        {
+            return ::new (p) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            deallocate(p);
+            throw;
+        }
+    }
+
+    static void destroy(T *p)
+    {
+        if (p != NULL)
+        {
+            p->~T();
+            deallocate(p);
+        }
+    }
+};
+
+// stateless STL allocator: single objects (container nodes) come from the
+// typed bucket, arrays from the size class buckets or the large blocks of
+// mp_malloc, aligned for T by mp_bucket_malloc_aligned.
+template <class T>
+class pool_allocator
+{
+public:
+    typedef T value_type;
+    typedef std::true_type is_always_equal;
+    typedef std::true_type propagate_on_container_move_assignment;
+
+    pool_allocator() {}
+    template <class U>
+    pool_allocator(const pool_allocator<U> &) {}
+
+    T *allocate(std::size_t n)
+    {
+        void *p;
+        if (n == 1)
+        {
+            return static_cast<T *>(object_pool<T>::allocate());
+        }
+        if (n > (std::size_t)-1 / sizeof(T))
+        {
+            throw std::bad_alloc();
+        }
+        p = mp_bucket_malloc_aligned(NULL, alignof(T), n * sizeof(T), 'jbol');
+        if (p == NULL)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, std::size_t n)
+    {
+        if (n == 1)
+        {
+            object_pool<T>::deallocate(p);
+        }
+        else
+        {
+            mp_free(p);
+        }
+    }
+};
+
+template <class T, class U>
+bool operator==(const pool_allocator<T> &, const pool_allocator<U> &) { return true; }
+template <class T, class U>
+bool operator!=(const pool_allocator<T> &, const pool_allocator<U> &) { return false; }
+
+}
+
+#endif
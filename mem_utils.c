@@ -1,3 +1,6 @@
+#if !defined(NDIS_WDM) && !defined(WIN32)
+#define _GNU_SOURCE
+#endif
 #include "mem_utils.h"
 #include "kprint.h"
 
@@ -7,6 +10,20 @@
 #include <ndis.h>
 #else
 #include <stdio.h>
+#include <stdlib.h>
+#include "interlocked_defs.h"
+#endif
+
+#if !defined(NDIS_WDM) && !defined(WIN32)
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define MEMORY_MPOL_PREFERRED 1
+// the bounded string functions of the Microsoft CRT
+#define sprintf_s snprintf
+#define strcat_s(dest, size, src) strncat(dest, src, (size) - strlen(dest) - 1)
 #endif
 
 typedef struct {
@@ -14,7 +31,29 @@ typedef struct {
 	long volatile free_num;
 } memory_counter_t;
 
-memory_counter_t g_memory_counter[4][256] = { 0 };
+// every cpu counts into its own table, check_memory sums them. A table
+// spans many cache lines, so two cpus only share a line when they share
+// a shard.
+#define MEMORY_COUNTER_SHARDS 16
+
+memory_counter_t g_memory_counter[MEMORY_COUNTER_SHARDS][4][256] = { 0 };
+
+static int memory_counter_shard()
+{
+	int cpu;
+#if defined(NDIS_WDM)
+	cpu = (int)KeGetCurrentProcessorNumber();
+#elif defined(WIN32)
+	cpu = (int)GetCurrentProcessorNumber();
+#else
+	cpu = sched_getcpu();
+	if (cpu < 0)
+	{
+		cpu = 0;
+	}
+#endif
+	return cpu % MEMORY_COUNTER_SHARDS;
+}
 
 #define USE_MEMORY_COUNTER
 #ifdef USE_MEMORY_COUNTER
@@ -26,15 +65,17 @@ memory_counter_t g_memory_counter[4][256] = { 0 };
 void memory_count(unsigned long tag, int alloc_or_free)
 {
 	int i;
+	memory_counter_t (*counter)[256];
+	counter = g_memory_counter[memory_counter_shard()];
 	for (i = 0; i < 4; i++)
 	{
 		if (alloc_or_free != 0)
 		{
-			InterlockedIncrement(&g_memory_counter[i][(tag >> (i * 8)) & 0xFF].alloc_num);
+			InterlockedIncrement(&counter[i][(tag >> (i * 8)) & 0xFF].alloc_num);
 		}
 		else
 		{
-			InterlockedIncrement(&g_memory_counter[i][(tag >> (i * 8)) & 0xFF].free_num);
+			InterlockedIncrement(&counter[i][(tag >> (i * 8)) & 0xFF].free_num);
 		}
 	}
 }
@@ -79,7 +120,9 @@ void *memory_alloc(size_t size, unsigned long tag)
 	if (ptr != NULL)
 	{
 #ifdef USE_MEMORY_COUNTER
-		memory_count(*(unsigned long *)ptr, 1);
+		// memory_free finds the tag in the header
+		*(unsigned long *)ptr = tag;
+		memory_count(tag, 1);
 #endif
 		return (char *)ptr + ALLOC_HEADER_SIZE;
 	}
@@ -101,6 +144,185 @@ void memory_free(void *ptr)
 	internal_memory_free(actual);
 }
 
+#if !defined(NDIS_WDM) && !defined(WIN32)
+// maps size bytes at a multiple of align, which is a power of two
+static void *page_map_aligned(size_t size, size_t align)
+{
+	unsigned char *actual;
+	size_t head;
+	size_t tail;
+	actual = mmap(NULL, 
+		size + align, 
+		PROT_READ | PROT_WRITE, 
+		MAP_PRIVATE | MAP_ANONYMOUS, 
+		-1, 
+		0);
+	if (actual == MAP_FAILED)
+	{
+		return NULL;
+	}
+	head = (align - ((size_t)actual & (align - 1))) & (align - 1);
+	tail = align - head;
+	if (head != 0)
+	{
+		munmap(actual, head);
+	}
+	if (tail != 0)
+	{
+		munmap(actual + head + size, tail);
+	}
+	return actual + head;
+}
+
+static void page_bind_node(void *ptr, size_t size, int node)
+{
+	if (node >= 0 && node < (int)(sizeof(unsigned long) * 8))
+	{
+		// pages aren't touched yet, a failure only loses the placement hint
+		unsigned long mask = 1UL << node;
+		syscall(SYS_mbind, ptr, size, MEMORY_MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+	}
+}
+#endif
+
+void *page_alloc(size_t size, unsigned long tag)
+{
+	return page_alloc_node(size, -1, tag);
+}
+
+void *page_alloc_node(size_t size, int node, unsigned long tag)
+{
+	void *ptr;
+#if defined(NDIS_WDM)
+	// no aligned allocator here, keep the original address just below the aligned one
+	void *actual;
+	actual = internal_memory_alloc(size + PAGE_ALLOC_GRANULARITY + sizeof(void *), tag);
+	if (actual == NULL)
+	{
+		return NULL;
+	}
+	ptr = (void *)(((ULONG_PTR)actual + sizeof(void *) + PAGE_ALLOC_GRANULARITY - 1) 
+		& ~((ULONG_PTR)PAGE_ALLOC_GRANULARITY - 1));
+	((void **)ptr)[-1] = actual;
+	RtlZeroMemory(ptr, size);
+#elif defined(WIN32)
+	// allocation granularity of VirtualAlloc is 64K already
+	if (node >= 0)
+	{
+		ptr = VirtualAllocExNuma(GetCurrentProcess(), 
+			NULL, 
+			size, 
+			MEM_RESERVE | MEM_COMMIT, 
+			PAGE_READWRITE, 
+			(DWORD)node);
+	}
+	else
+	{
+		ptr = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+	if (ptr == NULL)
+	{
+		return NULL;
+	}
+#else
+	ptr = page_map_aligned(size, PAGE_ALLOC_GRANULARITY);
+	if (ptr == NULL)
+	{
+		return NULL;
+	}
+	page_bind_node(ptr, size, node);
+#endif
+#ifdef USE_MEMORY_COUNTER
+	memory_count(tag, 1);
+#endif
+	return ptr;
+}
+
+void *page_alloc_huge(size_t size, int node, int explicit_pages, unsigned long tag)
+{
+	void *ptr;
+#if defined(NDIS_WDM)
+	UNREFERENCED_PARAMETER(explicit_pages);
+	return page_alloc_node(size, node, tag);
+#elif defined(WIN32)
+	SIZE_T large;
+	ptr = NULL;
+	large = GetLargePageMinimum();
+	// needs SeLockMemoryPrivilege, plain pages otherwise
+	if (explicit_pages != 0 && large != 0 && size % large == 0)
+	{
+		ptr = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+	}
+	if (ptr == NULL)
+	{
+		return page_alloc_node(size, node, tag);
+	}
+#else
+	ptr = NULL;
+#ifdef MAP_HUGETLB
+	if (explicit_pages != 0)
+	{
+		ptr = mmap(NULL, 
+			size, 
+			PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 
+			-1, 
+			0);
+		if (ptr == MAP_FAILED)
+		{
+			ptr = NULL;
+		}
+	}
+#endif
+	if (ptr == NULL)
+	{
+		ptr = page_map_aligned(size, PAGE_HUGE_SIZE);
+		if (ptr == NULL)
+		{
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	}
+	page_bind_node(ptr, size, node);
+#endif
+#ifdef USE_MEMORY_COUNTER
+	memory_count(tag, 1);
+#endif
+	return ptr;
+}
+
+void page_free(void *ptr, size_t size, unsigned long tag)
+{
+	if (ptr == NULL)
+	{
+		return;
+	}
+#ifdef USE_MEMORY_COUNTER
+	memory_count(tag, 0);
+#endif
+#if defined(NDIS_WDM)
+	internal_memory_free(((void **)ptr)[-1]);
+#elif defined(WIN32)
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, size);
+#endif
+}
+
+void page_reset(void *ptr, size_t size)
+{
+#if defined(NDIS_WDM)
+	UNREFERENCED_PARAMETER(ptr);
+	UNREFERENCED_PARAMETER(size);
+#elif defined(WIN32)
+	VirtualAlloc(ptr, size, MEM_RESET, PAGE_READWRITE);
+#else
+	madvise(ptr, size, MADV_DONTNEED);
+#endif
+}
+
 char get_printable(int c)
 {
 	if (c >= 20 && c < 127)
@@ -116,23 +338,32 @@ char get_printable(int c)
 void check_memory()
 {
 	char line[1024];
-	int i, j;
+	int i, j, k;
 	int leaked = 0;
+	long alloc_num;
+	long free_num;
 	for (i = 0; i < 4; i++)
 	{
 		line[0] = '\0';
 		for (j = 0; j < 256; j++)
 		{
-			if (g_memory_counter[i][j].alloc_num != g_memory_counter[i][j].free_num)
+			alloc_num = 0;
+			free_num = 0;
+			for (k = 0; k < MEMORY_COUNTER_SHARDS; k++)
+			{
+				alloc_num += g_memory_counter[k][i][j].alloc_num;
+				free_num += g_memory_counter[k][i][j].free_num;
+			}
+			if (alloc_num != free_num)
 			{
 				char record[64];
 #ifdef NDIS_WDM
 				if (STATUS_SUCCESS == RtlStringCbPrintfA(record,
 					sizeof(record),
-					" \t%c(%d, %d)",
+					" \t%c(%ld, %ld)",
 					get_printable(j),
-					g_memory_counter[i][j].alloc_num,
-					g_memory_counter[i][j].free_num))
+					alloc_num,
+					free_num))
 				{
 					if (STATUS_SUCCESS != RtlStringCchCatA(line, sizeof(line), record))
 					{
@@ -148,10 +379,10 @@ void check_memory()
 #else
 				if (0 < sprintf_s(record,
 					sizeof(record),
-					" \t%c(%d, %d)",
+					" \t%c(%ld, %ld)",
 					get_printable(j),
-					g_memory_counter[i][j].alloc_num,
-					g_memory_counter[i][j].free_num))
+					alloc_num,
+					free_num))
 				{
 					strcat_s(line, sizeof(line), record);
 				}
@@ -12,9 +12,27 @@ extern "C"
 #include <stddef.h>
 #endif
 
+// page_alloc returns zeroed memory aligned to PAGE_ALLOC_GRANULARITY
+#define PAGE_ALLOC_GRANULARITY  0x10000
+#define PAGE_HUGE_SIZE          0x200000
+
 void *memory_alloc(size_t size, unsigned long tag);
 void memory_free(void *ptr);
+void *page_alloc(size_t size, unsigned long tag);
+// node < 0 lets the system place the pages
+void *page_alloc_node(size_t size, int node, unsigned long tag);
+// size is a multiple of PAGE_HUGE_SIZE, the memory is aligned to it and
+// backed by huge pages where the system has them, explicit ones first if
+// explicit_pages is set. page_free releases it.
+void *page_alloc_huge(size_t size, int node, int explicit_pages, unsigned long tag);
+void page_free(void *ptr, size_t size, unsigned long tag);
+// drops the content of pages but keeps them mapped, they read back as zero
+// (or undefined on Windows) and take memory again once written
+void page_reset(void *ptr, size_t size);
 void check_memory();
+// not counted by check_memory, for memory that outlives the pool
+void *internal_memory_alloc(size_t size, unsigned int tag);
+void internal_memory_free(void *p);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,101 @@
+#include "mp_arena.h"
+
+#define MP_ARENA_ROUND(x)           (((x) + MP_ARENA_ALIGN - 1) & ~(size_t)(MP_ARENA_ALIGN - 1))
+#define MP_ARENA_HEADER_SIZE        MP_ARENA_ROUND(sizeof(mp_arena_t))
+#define MP_ARENA_CHUNK_HEADER_SIZE  MP_ARENA_ROUND(sizeof(mp_arena_chunk_t))
+#define MP_ARENA_MIN_CHUNK_SIZE     0x1000
+// chunks given back per mp_free_bulk
+#define MP_ARENA_FREE_BATCH         32
+
+static __inline void *mp_arena_chunk_alloc(memory_pool_t *pool, size_t size)
+{
+    return (pool != NULL) ? mp_pool_malloc(pool, size) : mp_malloc(size);
+}
+
+mp_arena_t *mp_arena_create(memory_pool_t *pool, size_t chunk_size)
+{
+    mp_arena_t *arena;
+    if (chunk_size == 0)
+    {
+        chunk_size = MP_ARENA_CHUNK_SIZE;
+    }
+    if (chunk_size < MP_ARENA_MIN_CHUNK_SIZE)
+    {
+        chunk_size = MP_ARENA_MIN_CHUNK_SIZE;
+    }
+    arena = (mp_arena_t *)mp_arena_chunk_alloc(pool, chunk_size);
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+    arena->chunks = NULL;
+    arena->pool = pool;
+    arena->chunk_size = chunk_size;
+    // the size class of the block may be larger than chunk_size
+    arena->first_end = (unsigned char *)arena + mp_usable_size(arena);
+    arena->cur = (unsigned char *)arena + MP_ARENA_HEADER_SIZE;
+    arena->end = arena->first_end;
+    return arena;
+}
+
+void *mp_arena_alloc_slow(mp_arena_t *arena, size_t size)
+{
+    size_t n;
+    unsigned char *p;
+    mp_arena_chunk_t *chunk;
+    if (size > (size_t)-1 - MP_ARENA_CHUNK_HEADER_SIZE - MP_ARENA_ALIGN)
+    {
+        return NULL;
+    }
+    n = (size == 0) ? MP_ARENA_ALIGN : MP_ARENA_ROUND(size);
+    if (n > arena->chunk_size / 4)
+    {
+        // the current chunk goes on serving the small ones
+        chunk = (mp_arena_chunk_t *)mp_arena_chunk_alloc(arena->pool, MP_ARENA_CHUNK_HEADER_SIZE + n);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        return (unsigned char *)chunk + MP_ARENA_CHUNK_HEADER_SIZE;
+    }
+    chunk = (mp_arena_chunk_t *)mp_arena_chunk_alloc(arena->pool, arena->chunk_size);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    p = (unsigned char *)chunk + MP_ARENA_CHUNK_HEADER_SIZE;
+    arena->cur = p + n;
+    arena->end = (unsigned char *)chunk + mp_usable_size(chunk);
+    return p;
+}
+
+// the chunks go back to their buckets a batch at a time
+void mp_arena_reset(mp_arena_t *arena)
+{
+    int n;
+    void *batch[MP_ARENA_FREE_BATCH];
+    mp_arena_chunk_t *chunk;
+    chunk = arena->chunks;
+    while (chunk != NULL)
+    {
+        // links of a batch are read before it's freed
+        for (n = 0; chunk != NULL && n < MP_ARENA_FREE_BATCH; chunk = chunk->next)
+        {
+            batch[n++] = chunk;
+        }
+        mp_free_bulk(n, batch);
+    }
+    arena->chunks = NULL;
+    arena->cur = (unsigned char *)arena + MP_ARENA_HEADER_SIZE;
+    arena->end = arena->first_end;
+}
+
+void mp_arena_destroy(mp_arena_t *arena)
+{
+    mp_arena_reset(arena);
+    mp_free(arena);
+}
@@ -0,0 +1,64 @@
+#ifndef MP_ARENA_H_7C41D2A9_0E5B_4c86_B3F2_19D6A8E4C073
+#define MP_ARENA_H_7C41D2A9_0E5B_4c86_B3F2_19D6A8E4C073
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "mem_pool.h"
+
+// a region for blocks that die together: allocation bumps a pointer through
+// chunks taken from the pool's buckets, there's no free of single blocks.
+// mp_arena_reset gives every chunk but the first back at once, so the next
+// request starts over in the chunk holding the arena itself. An arena is
+// used by one thread at a time.
+
+// blocks are aligned like malloc's
+#define MP_ARENA_ALIGN      16
+// a size class of the pool, so chunks come from the thread cache
+#define MP_ARENA_CHUNK_SIZE 0x10000
+
+typedef struct _mp_arena_chunk
+{
+    struct _mp_arena_chunk *next;
+} mp_arena_chunk_t;
+
+typedef struct _mp_arena
+{
+    unsigned char *cur;
+    unsigned char *end;
+    mp_arena_chunk_t *chunks;   // taken since the last reset, newest first
+    memory_pool_t *pool;        // NULL for the pools of mp_malloc
+    size_t chunk_size;
+    unsigned char *first_end;
+} mp_arena_t;
+
+// chunk_size 0 picks MP_ARENA_CHUNK_SIZE, the arena lives in its first chunk
+mp_arena_t *mp_arena_create(memory_pool_t *pool, size_t chunk_size);
+void mp_arena_reset(mp_arena_t *arena);
+void mp_arena_destroy(mp_arena_t *arena);
+// takes a new chunk, or a chunk of its own for sizes over a quarter of one
+void *mp_arena_alloc_slow(mp_arena_t *arena, size_t size);
+
+static __inline void *mp_arena_alloc(mp_arena_t *arena, size_t size)
+{
+    size_t n;
+    unsigned char *p;
+    // a zero size takes MP_ARENA_ALIGN like in mp_arena_alloc_slow, so
+    // every block has an address of its own
+    n = ((size != 0 ? size : 1) + MP_ARENA_ALIGN - 1) & ~(size_t)(MP_ARENA_ALIGN - 1);
+    if (n >= size && n <= (size_t)(arena->end - arena->cur))
+    {
+        p = arena->cur;
+        arena->cur += n;
+        return p;
+    }
+    return mp_arena_alloc_slow(arena, size);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,251 @@
+// malloc interposer on top of the memory pool, for running unchanged
+// programs with LD_PRELOAD (Linux, glibc):
+//
+//   ./build.sh preload
+//   LD_PRELOAD=./libmp_preload.so program
+//
+// Pool blocks are told from the others with the page map, that's why it
+// needs MP_HEADERLESS_SMALL. glibc's allocator serves whatever the pool
+// can't: calls before mp_init is done and the allocations of the pool
+// itself (thread caches, magazines). free and realloc send a block back
+// to where it came from.
+
+#include <errno.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "mem_pool.h"
+#include "thread_defs.h"
+#include "interlocked_defs.h"
+
+#ifndef MP_HEADERLESS_SMALL
+#error "mp_preload.c needs MP_HEADERLESS_SMALL to tell pool blocks from glibc ones"
+#endif
+
+#define MP_PRELOAD_USABLE_PERCENTS  10
+#define MP_PRELOAD_MIN_USABLE       0x4000000
+// malloc guarantees max_align_t, sizes are rounded to it so that the
+// strides of headerless buckets keep it
+#define MP_PRELOAD_ALIGN            16
+#define MP_PRELOAD_TAG              'lpfl'
+
+#define MP_PRELOAD_NONE     0
+#define MP_PRELOAD_STARTING 1
+#define MP_PRELOAD_READY    2
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *p);
+
+static volatile int g_preload_state = MP_PRELOAD_NONE;
+// set while the pool runs on this thread, its own allocations go to glibc
+static THREAD_LOCAL int t_in_pool = 0;
+static size_t (*g_libc_usable_size)(void *p) = NULL;
+
+// the first call initializes the pool, calls of other threads meanwhile
+// go to glibc
+static int mp_preload_ready()
+{
+    if (g_preload_state == MP_PRELOAD_READY)
+    {
+        return 1;
+    }
+    if (MP_PRELOAD_NONE != InterlockedCompareExchange(&g_preload_state,
+        MP_PRELOAD_STARTING,
+        MP_PRELOAD_NONE))
+    {
+        return 0;
+    }
+    t_in_pool = 1;
+    mp_init(MP_PRELOAD_USABLE_PERCENTS, MP_PRELOAD_MIN_USABLE);
+    t_in_pool = 0;
+    InterlockedExchange(&g_preload_state, MP_PRELOAD_READY);
+    return 1;
+}
+
+// size rounded to MP_PRELOAD_ALIGN, 0 if it overflows
+static size_t mp_preload_size(size_t size)
+{
+    if (size > (size_t)-1 - MP_PRELOAD_ALIGN)
+    {
+        return 0;
+    }
+    return (size == 0) ? MP_PRELOAD_ALIGN : (size + MP_PRELOAD_ALIGN - 1) & ~(size_t)(MP_PRELOAD_ALIGN - 1);
+}
+
+static void *mp_preload_malloc(size_t size)
+{
+    void *p;
+    size = mp_preload_size(size);
+    t_in_pool = 1;
+    p = (size != 0) ? mp_bucket_malloc(NULL, size, MP_PRELOAD_TAG) : NULL;
+    t_in_pool = 0;
+    if (p == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+static void mp_preload_free(void *p)
+{
+    int in_pool;
+    in_pool = t_in_pool;
+    t_in_pool = 1;
+    mp_free(p);
+    t_in_pool = in_pool;
+}
+
+void *malloc(size_t size)
+{
+    if (t_in_pool || !mp_preload_ready())
+    {
+        return __libc_malloc(size);
+    }
+    return mp_preload_malloc(size);
+}
+
+void free(void *p)
+{
+    if (p == NULL)
+    {
+        return;
+    }
+    if (mp_block_owned(p))
+    {
+        mp_preload_free(p);
+    }
+    else
+    {
+        __libc_free(p);
+    }
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p;
+    if (t_in_pool || !mp_preload_ready())
+    {
+        return __libc_calloc(n, size);
+    }
+    if (size != 0 && n > (size_t)-1 / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = mp_preload_size(n * size);
+    t_in_pool = 1;
+    p = (size != 0) ? mp_bucket_calloc(NULL, 1, size, MP_PRELOAD_TAG) : NULL;
+    t_in_pool = 0;
+    if (p == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void *realloc(void *p, size_t size)
+{
+    void *q;
+    int in_pool;
+    if (p == NULL)
+    {
+        return malloc(size);
+    }
+    if (!mp_block_owned(p))
+    {
+        return __libc_realloc(p, size);
+    }
+    if (size == 0)
+    {
+        mp_preload_free(p);
+        return NULL;
+    }
+    size = mp_preload_size(size);
+    if (size == 0)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // blocks of the pool move within the pool even before it's ready
+    in_pool = t_in_pool;
+    t_in_pool = 1;
+    q = mp_bucket_realloc(NULL, p, size, MP_PRELOAD_TAG);
+    t_in_pool = in_pool;
+    if (q == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return q;
+}
+
+static void *mp_preload_memalign(size_t align, size_t size)
+{
+    void *p;
+    if (align <= MP_PRELOAD_ALIGN)
+    {
+        return malloc(size);
+    }
+    if (t_in_pool || !mp_preload_ready())
+    {
+        return __libc_memalign(align, size);
+    }
+    size = mp_preload_size(size);
+    t_in_pool = 1;
+    p = (size != 0) ? mp_bucket_malloc_aligned(NULL, align, size, MP_PRELOAD_TAG) : NULL;
+    t_in_pool = 0;
+    if (p == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *p;
+    if (align == 0 || (align & (align - 1)) != 0 || align % sizeof(void *) != 0)
+    {
+        return EINVAL;
+    }
+    p = mp_preload_memalign(align, size);
+    if (p == NULL)
+    {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return mp_preload_memalign(align, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return aligned_alloc(align, size);
+}
+
+size_t malloc_usable_size(void *p)
+{
+    if (p == NULL)
+    {
+        return 0;
+    }
+    if (mp_block_owned(p))
+    {
+        return mp_usable_size(p);
+    }
+    if (g_libc_usable_size == NULL)
+    {
+        g_libc_usable_size = (size_t (*)(void *))dlsym(RTLD_NEXT, "malloc_usable_size");
+    }
+    return (g_libc_usable_size != NULL) ? g_libc_usable_size(p) : 0;
+}
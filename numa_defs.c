@@ -0,0 +1,139 @@
+#ifndef WIN32
+#define _GNU_SOURCE
+#endif
+#include "numa_defs.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <Windows.h>
+#else
+#include <sched.h>
+#endif
+
+#define MAX_NUMA_CPUS   1024
+
+static int g_numa_node_count = 1;
+#ifndef WIN32
+static unsigned char g_cpu_to_node[MAX_NUMA_CPUS];
+#endif
+
+#ifndef WIN32
+// parses a sysfs cpu list like "0-3,8-11" and maps every cpu in it to node
+static void parse_cpu_list(const char *path, int node)
+{
+    FILE *fp;
+    char line[1024];
+    char *p;
+    int first;
+    int last;
+    int n;
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return;
+    }
+    if (fgets(line, sizeof(line), fp) != NULL)
+    {
+        p = line;
+        while (sscanf(p, "%d%n", &first, &n) == 1)
+        {
+            p += n;
+            last = first;
+            if (*p == '-')
+            {
+                p++;
+                if (sscanf(p, "%d%n", &last, &n) != 1)
+                {
+                    break;
+                }
+                p += n;
+            }
+            for (; first <= last && first < MAX_NUMA_CPUS; first++)
+            {
+                g_cpu_to_node[first] = (unsigned char)node;
+            }
+            if (*p != ',')
+            {
+                break;
+            }
+            p++;
+        }
+    }
+    fclose(fp);
+}
+#endif
+
+void init_numa_topology()
+{
+#ifdef WIN32
+    ULONG highest;
+    if (GetNumaHighestNodeNumber(&highest))
+    {
+        g_numa_node_count = (int)highest + 1;
+    }
+#else
+    char path[128];
+    int node;
+    memset(g_cpu_to_node, 0, sizeof(g_cpu_to_node));
+    g_numa_node_count = 1;
+    for (node = 0; node < 1024; node++)
+    {
+        FILE *fp;
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+        fp = fopen(path, "r");
+        if (fp == NULL)
+        {
+            // node ids may be sparse, but the online ones are dense in practice
+            break;
+        }
+        fclose(fp);
+        parse_cpu_list(path, (node < MAX_NUMA_NODES) ? node : MAX_NUMA_NODES - 1);
+        g_numa_node_count = node + 1;
+    }
+#endif
+    if (g_numa_node_count > MAX_NUMA_NODES)
+    {
+        g_numa_node_count = MAX_NUMA_NODES;
+    }
+}
+
+int get_numa_node_count()
+{
+    return g_numa_node_count;
+}
+
+int get_current_cpu()
+{
+#ifdef WIN32
+    return (int)GetCurrentProcessorNumber();
+#else
+    return sched_getcpu();
+#endif
+}
+
+int get_current_numa_node()
+{
+#ifdef WIN32
+    PROCESSOR_NUMBER proc;
+    USHORT node;
+    GetCurrentProcessorNumberEx(&proc);
+    if (!GetNumaProcessorNodeEx(&proc, &node) || node >= MAX_NUMA_NODES)
+    {
+        return 0;
+    }
+    return node;
+#else
+    int cpu;
+    if (g_numa_node_count <= 1)
+    {
+        return 0;
+    }
+    cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= MAX_NUMA_CPUS)
+    {
+        return 0;
+    }
+    return g_cpu_to_node[cpu];
+#endif
+}
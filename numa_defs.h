@@ -0,0 +1,22 @@
+#ifndef NUMA_DEFS_H
+#define NUMA_DEFS_H
+
+#ifdef __cplusplus
+extern  "C"
+{
+#endif
+
+#define MAX_NUMA_NODES  8
+
+// reads the topology once, nodes beyond MAX_NUMA_NODES are folded into the last one.
+void init_numa_topology();
+int get_numa_node_count();
+int get_current_numa_node();
+// -1 if the platform can't tell
+int get_current_cpu();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
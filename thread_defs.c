@@ -88,3 +88,32 @@ void close_thread_handle(thread_handle_t handle)
 #else
 #endif
 }
+
+int create_tls_key(tls_key_t *key, void (TLS_CALLBACK *destructor)(void *))
+{
+#ifdef WIN32
+    // fiber local storage is the only Win32 slot that calls back on thread exit
+    *key = FlsAlloc(destructor);
+    return (*key != FLS_OUT_OF_INDEXES) ? 0 : -1;
+#else
+    return pthread_key_create(key, destructor);
+#endif
+}
+
+void delete_tls_key(tls_key_t key)
+{
+#ifdef WIN32
+    FlsFree(key);
+#else
+    pthread_key_delete(key);
+#endif
+}
+
+void set_tls_value(tls_key_t key, void *value)
+{
+#ifdef WIN32
+    FlsSetValue(key, value);
+#else
+    pthread_setspecific(key, value);
+#endif
+}
@@ -9,9 +9,15 @@ extern  "C"
 #ifdef WIN32
 #include <Windows.h>
 #define thread_handle_t   HANDLE
+#define tls_key_t         DWORD
+#define THREAD_LOCAL      __declspec(thread)
+#define TLS_CALLBACK      WINAPI
 #else
 #include <pthread.h>
 #define thread_handle_t   pthread_t 
+#define tls_key_t         pthread_key_t
+#define THREAD_LOCAL      __thread
+#define TLS_CALLBACK
 #endif
 
 thread_handle_t create_thread(void *(*thread_proc)(void *), void *arg);
@@ -19,6 +25,11 @@ void close_thread_handle(thread_handle_t handle);
 void wait_thread(thread_handle_t handle);
 void wait_threads(thread_handle_t *handles, int count);
 
+// destructor is invoked on thread exit for every thread whose value is not NULL
+int create_tls_key(tls_key_t *key, void (TLS_CALLBACK *destructor)(void *));
+void delete_tls_key(tls_key_t key);
+void set_tls_value(tls_key_t key, void *value);
+
 #ifdef __cplusplus
 }
 #endif